@@ -27,8 +27,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <ftdi.h>
 
+#include "nand-sim.h"
+
 // #define DEBUG 
 
 #ifdef DEBUG
@@ -65,36 +70,122 @@
 #define PIN_nWP  0x20
 #define PIN_RDY  0x40 /* READY / nBUSY output signal */
 #define PIN_LED  0x80
+#define PIN_nCE2 PIN_LED /* second die's chip enable, with -D 2 */
 #define CONTROLBUS_BITMASK 0xBF /* 0b1011 1111 = 0xBF */
 
+/*
+ * MCU host bus emulation wiring: IO0..7 on ADBUS0..7 (AD7..0), nRE on RD#
+ * (BDBUS2), nWE on WR# (BDBUS3), READY / nBUSY on I/O1 (BDBUS7) and the
+ * other control lines on the high address byte (ACBUS4..7 = A12..A15).
+ */
+#define MCU_ADDR_nCE 0x10
+#define MCU_ADDR_nWP 0x20
+#define MCU_ADDR_CLE 0x40
+#define MCU_ADDR_ALE 0x80
+#define MCU_ADDR_nCE2 0x01 /* ACBUS0 (A8), second die's chip enable */
+#define MCU_IO1_RDY  0x02 /* READY / nBUSY as returned by GET_BITS_HIGH */
+
 #define STATUSREG_IO0  0x01
+#define STATUSREG_IO1  0x02 /* pass/fail of the previous page (cache program) */
+#define STATUSREG_IO6  0x40 /* ready */
 
 #define REALWORLD_DELAY 10 /* 10 usec */
 
-#define PAGE_SIZE 2112
-#define PAGE_SIZE_NOSPARE 2048
-#define PAGE_PER_BLOCK 64
-#define BLOCK_COUNT 2048
+/* geometry of the chip the tool was written for, see chip_geometry_t */
+#define DEFAULT_PAGE_SIZE 2112
+#define DEFAULT_PAGE_SIZE_NOSPARE 2048
+#define DEFAULT_PAGE_PER_BLOCK 64
+#define DEFAULT_BLOCK_COUNT 2048
+#define DEFAULT_PLANE_COUNT 2
+#define PAGE_SIZE_MAX (16384 + 2048) /* largest page (with spare area) handled */
+#define PLANE_MAX 2 /* multi-plane ops pair up at most this many blocks */
+#define PLANE_GROUP_PAGES (geometry.planes * geometry.pages_per_block) /* blocks that multi-plane ops pair up */
+#define ADDRESS_CYCLES (geometry.column_cycles + geometry.row_cycles) /* column and row */
 
 #define DEFAULT_FILENAME "flashdump.bin"
 #define DEFAULT_START_PAGE 0
-#define DEFAULT_PAGE_COUNT 131072
+#define DEFAULT_PAGE_COUNT 131072 /* per die */
+#define DEFAULT_COLUMN_CYCLES 2
+#define DEFAULT_ROW_CYCLES 3
+#define CHIP_DB_FILE ".flash-tool-chips" /* in $HOME, see chip_db_lookup() */
+#define BBT_FILE ".flash-tool-bbt" /* in $HOME, see bbt_load() */
+#define DIE_MAX 2 /* chips on the bus, each with its own nCE (-D) */
+#define DIE_NONE -1
 #define DEFAULT_DELAY 0
+#define DEFAULT_WAIT_METHOD "rdy"
+#define DEFAULT_SAMPLE_RATE 1000000 /* bit-bang pin updates per second (-r) */
+#define DEFAULT_LATENCY_MS 1 /* USB latency timer, so partial packets come back quickly (-l) */
+#define DEFAULT_ENGINE "bitbang"
+
+#define ASYNC_MAX_DEPTH 16 /* max USB transfers in flight (-a) */
 
 
 const unsigned char CMD_READID = 0x90; /* read ID register */
 const unsigned char CMD_READ1[2] = { 0x00, 0x30 }; /* page read */
+const unsigned char CMD_READCACHE[2] = { 0x31, 0x3F }; /* cache read: next page, last page */
+const unsigned char CMD_READMULTIPLANE = 0x32; /* page read, queued for a multi-plane read */
+const unsigned char CMD_CHANGEREADCOLUMN[2] = { 0x06, 0xE0 }; /* select plane and column for data output */
+const unsigned char CMD_RANDOMDATAOUTPUT[2] = { 0x05, 0xE0 }; /* data output from a new column */
 const unsigned char CMD_BLOCKERASE[2] = { 0x60, 0xD0 }; /* block erase */
+const unsigned char CMD_BLOCKERASEMULTIPLANE = 0xD1; /* block erase, queued for a multi-plane erase */
 const unsigned char CMD_READSTATUS = 0x70; /* read status */
+const unsigned char CMD_READSTATUSENHANCED = 0x78; /* read status of the die at a row address */
 const unsigned char CMD_PAGEPROGRAM[2] = { 0x80, 0x10 }; /* program page */
+const unsigned char CMD_CACHEPROGRAM = 0x15; /* program page, cache register free for the next one */
+const unsigned char CMD_PAGEPROGRAMMULTIPLANE = 0x11; /* program page, queued for a multi-plane program */
+const unsigned char CMD_READCOPYBACK[2] = { 0x00, 0x35 }; /* page read, for a copy-back program */
+const unsigned char CMD_COPYBACKPROGRAM[2] = { 0x85, 0x10 }; /* program the page register elsewhere */
+const unsigned char CMD_CHANGEWRITECOLUMN = 0x85; /* random data input, at a new column */
+const unsigned char CMD_READPARAMETERPAGE = 0xEC; /* ONFI parameter page, address 00h */
+const unsigned char ONFI_ID_ADDRESS = 0x20; /* READ ID at this address gives "ONFI" */
+const unsigned char CMD_READUNIQUEID = 0xED; /* unique ID, address 00h */
+#define ONFI_PARAM_PAGE_SIZE 256
+
+/*
+ * Chip geometry. Starts out as the chip the tool was written for (which the
+ * simulators also emulate) and is filled in by chip_identify() once the ID
+ * is read, from the ONFI parameter page or the chip database.
+ */
+typedef struct _chip_geometry {
+    char name[48];
+    unsigned int page_size;         /* with spare area */
+    unsigned int page_size_nospare;
+    unsigned int pages_per_block;
+    unsigned int block_count;       /* per die */
+    unsigned int page_count;        /* per die */
+    unsigned int planes;            /* a block's plane is block % planes */
+    unsigned int column_cycles;     /* address cycles */
+    unsigned int row_cycles;
+} chip_geometry_t;
+
+chip_geometry_t geometry = {
+    .name = "default",
+    .page_size = DEFAULT_PAGE_SIZE,
+    .page_size_nospare = DEFAULT_PAGE_SIZE_NOSPARE,
+    .pages_per_block = DEFAULT_PAGE_PER_BLOCK,
+    .block_count = DEFAULT_BLOCK_COUNT,
+    .page_count = DEFAULT_PAGE_COUNT,
+    .planes = DEFAULT_PLANE_COUNT,
+    .column_cycles = DEFAULT_COLUMN_CYCLES,
+    .row_cycles = DEFAULT_ROW_CYCLES,
+};
 
 typedef enum { OFF=0, ON=1 } onoff_t;
 typedef enum { IOBUS_IN=0, IOBUS_OUT=1 } iobus_inout_t;
+typedef enum { CHAN_IOBUS=0, CHAN_CONTROLBUS=1 } bus_chan_t;
 
-unsigned char iobus_value;
-unsigned char controlbus_value;
+/* USB transfer counters, to see what each operation costs on the wire */
+typedef struct _usb_stats {
+    unsigned long writes;   /* bulk OUT transfers (ftdi_write_data) */
+    unsigned long bytes;    /* bytes sent through those transfers */
+    unsigned long reads;    /* pin reads (ftdi_read_pins, control transfers) */
+    unsigned long bulk_reads; /* bulk IN transfers (ftdi_read_data) */
+    unsigned long bitmodes; /* bitmode / direction changes (control transfers) */
+    unsigned long long time_us; /* bus clock when the snapshot was taken, see bus_stats() */
+} usb_stats_t;
 
-struct ftdi_context *nandflash_iobus, *nandflash_controlbus;
+typedef struct _nand_bus nand_bus_t;
+typedef struct _wait_engine wait_engine_t;
 
 typedef struct _prog_params {
     int start_page;
@@ -102,12 +193,41 @@ typedef struct _prog_params {
     int overwrite;
     int count;
     int delay; /* delay in usec */
+    int sample_rate; /* bit-bang pin updates per second, 0: from the link profile */
+    int latency_ms; /* USB latency timer, 0: from the link profile */
+    int chunk_size; /* USB transfer chunk size, 0: from the link profile */
+    int calibrate; /* find the fastest stable link settings and save them */
+    int basic_commands; /* don't use the chip's optional commands (-N) */
+    unsigned int features; /* optional commands the chip supports, CHIP_* */
     int test; /* run simple tests instead of dump */
     int do_program;
     char *input_file;
     int input_skip; /* Number of pages to first skip when programming */
     int do_erase;
     int start_block;
+    int unbatched; /* legacy bus I/O: one USB transfer per pin edge */
+    char *engine; /* bus backend name, see bus_backends[] */
+    char *engine_arg; /* engine option, after the ':' in -e name:arg */
+    int async_depth; /* USB transfers kept in flight, 0: synchronous I/O */
+    nand_bus_t *bus; /* bus the NAND operations run on */
+    char *wait_method; /* how to wait for ready: "rdy" or "status" (-W) */
+    int dies; /* chips on the bus, one nCE each (-D) */
+    int do_move; /* copy-back blocks inside the chip (-m) */
+    unsigned int move_src; /* first source block */
+    unsigned int move_dst; /* first destination block */
+    unsigned int move_count; /* blocks */
+    char *patch_file; /* columns to change on the way (-P) */
+    char *window; /* columns of each page to dump (-w), see window_setup() */
+    unsigned int window_start; /* first column of each page to dump */
+    unsigned int window_length; /* columns of each page to dump */
+    char *chip_db; /* chip database file (-g) */
+    int do_scan; /* scan the bad block markers into the table (-B) */
+    unsigned char *bad_blocks; /* bad block bitmap of all dies, NULL: no table */
+    int logical; /* good blocks only: logical image, -c in its pages (-L) */
+    int blank_check; /* don't erase blocks that are already erased (-z) */
+    int do_sync; /* only rewrite the blocks that differ from input_file (-y) */
+    int verify; /* read back and compare each group of pages programmed (-V) */
+    wait_engine_t *wait; /* ready/busy wait engine */
 } prog_params_t;
 
 
@@ -117,13 +237,18 @@ void reset_prog_params(prog_params_t *params)
     params->start_page = DEFAULT_START_PAGE;
     params->filename = DEFAULT_FILENAME;
     params->delay = DEFAULT_DELAY;
+    params->engine = DEFAULT_ENGINE;
+    params->wait_method = DEFAULT_WAIT_METHOD;
+    params->dies = 1;
 }
 
 void print_prog_params(prog_params_t *params)
 {
     printf("Params: start_page=%d (%x), count=%d, filename=%s, "
            "overwrite=%d, delay=%d, test=%d, program=%d (input file=%s, skip=%d) "
-           "erase=%d (start_block=%d)\n",
+           "erase=%d (start_block=%d) unbatched=%d engine=%s async=%d wait=%s "
+           "calibrate=%d basic_commands=%d dies=%d move=%d (%u to %u, %u blocks, patch=%s) "
+           "window=%s scan=%d logical=%d blank_check=%d sync=%d verify=%d\n",
         params->start_page,
         params->start_page,
         params->count,
@@ -135,25 +260,86 @@ void print_prog_params(prog_params_t *params)
         params->input_file,
         params->input_skip,
         params->do_erase,
-        params->start_block);
+        params->start_block,
+        params->unbatched,
+        params->engine,
+        params->async_depth,
+        params->wait_method,
+        params->calibrate,
+        params->basic_commands,
+        params->dies,
+        params->do_move,
+        params->move_src,
+        params->move_dst,
+        params->move_count,
+        params->patch_file,
+        params->window ? params->window : "page",
+        params->do_scan, params->logical, params->blank_check, params->do_sync,
+        params->verify);
 }
 
 void usage(char **argv)
 {
     printf("usage: %s  [-s start-page] [-c count] [-k skip-pages] [-d delay]" \
-           " [-b start-block] [-o] [-t] [-h] [-f output] [-p input]\n", argv[0]);
+           " [-b start-block] [-e engine] [-a depth] [-r rate] [-l ms] [-x bytes]" \
+           " [-g chip-db] [-B] [-L]" \
+           " [-W method] [-D dies] [-C] [-N] [-o] [-t] [-u] [-h] [-f output] [-w window]" \
+           " [-p input] [-y input] [-V]" \
+           " [-m src:dst[:count] [-P patch]] [-E [-z]]\n", argv[0]);
     printf("  -h      : this help\n");
 
+    printf("  -a n    : keep up to n USB transfers in flight (async I/O, default 0: off)\n");
+
     printf("  -b n    : start erasing at block n (erase)\n");
+    printf("  -B      : scan the bad block markers of the whole chip and save them in\n");
+    printf("            ~/%s; later runs on the chip skip its bad blocks (erase,\n", BBT_FILE);
+    printf("            program) or don't read them (dump, 0xFF in the file)\n");
     printf("  -c n    : only process n pages (dump, program) or blocks (erase)\n");
+    printf("  -C      : calibrate the USB link settings (-r, -l, -x) on the chip, reading\n");
+    printf("            page -s over and over, and save the fastest stable ones for this\n");
+    printf("            device; later runs pick them up\n");
     printf("  -d n    : add n usecs of delay for some operations (default 0)\n");
+    printf("  -D n    : n chips on the bus (default 1; 2: second nCE on the LED pin,\n");
+    printf("            ACBUS0 with -e mcu); pages and blocks of the second chip follow\n");
+    printf("            the first one's, programs and erases keep both busy at once\n");
+    printf("  -e name : bus engine: bitbang (2 channels, default), mpsse (ADBUS/ACBUS),\n");
+    printf("            mcu (host bus emulation; mcu:slow for a 12MHz bus clock)\n");
+    printf("            or sim[:file] (simulated NAND in file, default nand-sim.bin)\n");
     printf("  -E      : erase flash content (dangerous!)\n");
     printf("  -f name : name of output file when dumping (default: flashdump.bin)\n");
+    printf("  -g name : chip database file, for chips that aren't ONFI (default\n");
+    printf("            ~/%s, then the built-in chips)\n", CHIP_DB_FILE);
     printf("  -k n    : skip of n pages in input file when programming (program)\n");
+    printf("  -l n    : USB latency timer in ms (default 1, or the calibrated value)\n");
+    printf("  -L      : logical image, bad blocks left out (dump, program): the input\n");
+    printf("            blocks go to the good blocks in turn, dumps only hold the good\n");
+    printf("            blocks; -c counts pages of the image. Needs a table (-B)\n");
+    printf("  -m s:d[:n] : move n blocks (default 1) from block s to the erased block d\n");
+    printf("            with copy-back, inside the chip; same plane (s and d both even\n");
+    printf("            or both odd) and same die (dangerous!)\n");
+    printf("  -N      : stick to the basic commands: no cache read / program and no\n");
+    printf("            multi-plane operations, even if the chip has them\n");
     printf("  -o      : overwrite output file (dump)\n");
     printf("  -p name : program file 'name' into flash (dangerous!) (program)\n");
+    printf("  -P name : with -m, patch file of columns to change on the way, lines of\n");
+    printf("            <destination page> <column> <hex bytes>\n");
+    printf("  -r n    : bit-bang sample rate in Hz, the resolution of bus timings (default\n");
+    printf("            1000000, or the calibrated value)\n");
     printf("  -s n    : start page in flash (dump, program)\n");
     printf("  -t      : run tests to check correct wiring; DISCONNECT THE FLASH\n");
+    printf("  -u      : unbatched bus I/O, one USB transfer per pin edge (slow, legacy)\n");
+    printf("  -V      : verify what is programmed (-p, -y): read each block back once\n");
+    printf("            programmed and report the columns and bits that differ\n");
+    printf("  -w win  : only dump columns start:length of each page, or main (the\n");
+    printf("            data area) or oob (the spare area)\n");
+    printf("  -W name : wait for ready by polling the RDY pin (rdy, default) or the\n");
+    printf("            status register (status)\n");
+    printf("  -x n    : USB transfer chunk size in bytes (default: libftdi's, or the\n");
+    printf("            calibrated value)\n");
+    printf("  -y name : sync the flash with file 'name': read each block back and only\n");
+    printf("            erase and program it again if it differs (dangerous!) (program)\n");
+    printf("  -z      : with -E, read each block first and only erase it if it isn't\n");
+    printf("            erased already\n");
     printf("\n");
     printf("Examples:\n");
     printf("   %s -f /tmp/dump1.bin -s 10000 -c 500\n", argv[0]);
@@ -166,6 +352,12 @@ void usage(char **argv)
     printf("   %s -E -b 10 -c 5\n", argv[0]);
     printf("      erase 5 blocks, starting with block 10\n");
     printf("\n");
+    printf("   %s -f /tmp/oob.bin -w oob\n", argv[0]);
+    printf("      dump the spare area of every page into file /tmp/oob.bin\n");
+    printf("\n");
+    printf("   %s -m 10:200:2\n", argv[0]);
+    printf("      move blocks 10 and 11 to blocks 200 and 201 (erased before)\n");
+    printf("\n");
 }
 
 int parse_prog_params(prog_params_t *params, int argc, char **argv)
@@ -177,30 +369,69 @@ int parse_prog_params(prog_params_t *params, int argc, char **argv)
 
   opterr = 0;
 
-  while ((c = getopt(argc, argv, "b:c:d:Es:tf:hk:op:")) != -1)
+  while ((c = getopt(argc, argv, "a:b:Bc:Cd:D:e:Es:tf:g:hk:l:Lm:NoP:p:r:uVw:W:x:y:z")) != -1)
     switch (c)
       {
+      case 'a':
+        params->async_depth = atoi(optarg);
+        break;
       case 'b':
         params->start_block = atoi(optarg);
         break;
+      case 'B':
+        params->do_scan = 1;
+        break;
       case 'c':
         params->count = atoi(optarg);
         break;
+      case 'C':
+        params->calibrate = 1;
+        break;
       case 'd':
         params->delay = atoi(optarg);
         break;
+      case 'D':
+        params->dies = atoi(optarg);
+        break;
+      case 'e':
+        params->engine = optarg;
+        if ((params->engine_arg = strchr(optarg, ':')) != NULL)
+          *params->engine_arg++ = '\0';
+        break;
       case 'E':
         params->do_erase = 1;
         break;
       case 'f':
         params->filename = optarg;
         break;
+      case 'g':
+        params->chip_db = optarg;
+        break;
       case 'h':
         usage(argv);
         return -1;
       case 'k':
         params->input_skip = atoi(optarg);
         break;
+      case 'l':
+        params->latency_ms = atoi(optarg);
+        break;
+      case 'L':
+        params->logical = 1;
+        break;
+      case 'm':
+        params->do_move = 1;
+        params->move_count = 1;
+        if (sscanf(optarg, "%u:%u:%u", &params->move_src, &params->move_dst,
+                   &params->move_count) < 2)
+        {
+          fprintf(stderr, "-m takes source:destination[:count] blocks\n");
+          return -1;
+        }
+        break;
+      case 'N':
+        params->basic_commands = 1;
+        break;
       case 'o':
         params->overwrite = 1;
         break;
@@ -208,14 +439,49 @@ int parse_prog_params(prog_params_t *params, int argc, char **argv)
         params->do_program = 1;
         params->input_file = optarg;
         break;
+      case 'P':
+        params->patch_file = optarg;
+        break;
+      case 'r':
+        params->sample_rate = atoi(optarg);
+        break;
       case 's':
         params->start_page = atoi(optarg);
         break;
       case 't':
         params->test = 1;
         break;
+      case 'u':
+        params->unbatched = 1;
+        break;
+      case 'V':
+        params->verify = 1;
+        break;
+      case 'w':
+        params->window = optarg;
+        if (strcmp(optarg, "main") && strcmp(optarg, "oob")
+            && (sscanf(optarg, "%u:%u", &params->window_start, &params->window_length) != 2
+                || params->window_length == 0))
+        {
+          fprintf(stderr, "-w takes start:length columns, main or oob\n");
+          return -1;
+        }
+        break;
+      case 'W':
+        params->wait_method = optarg;
+        break;
+      case 'x':
+        params->chunk_size = atoi(optarg);
+        break;
+      case 'y':
+        params->do_sync = 1;
+        params->input_file = optarg;
+        break;
+      case 'z':
+        params->blank_check = 1;
+        break;
       case '?':
-        if (strchr("bcdsfkp", optopt))
+        if (strchr("abcdDesfgklmpPrwWxy", optopt))
           fprintf (stderr, "Option -%c requires an argument.\n", optopt);
         else 
           fprintf (stderr, "Unknown option `-%c'.\n", optopt);
@@ -238,9 +504,91 @@ int parse_prog_params(prog_params_t *params, int argc, char **argv)
       return -1;
   }
 
-  if (params->start_block)
+  if (params->async_depth < 0 || params->async_depth > ASYNC_MAX_DEPTH)
+  {
+      fprintf(stderr, "-a (async depth) must be between 0 and %d\n", ASYNC_MAX_DEPTH);
+      return -1;
+  }
+
+  if (strcmp(params->wait_method, "rdy") && strcmp(params->wait_method, "status"))
+  {
+      fprintf(stderr, "-W (wait method) must be rdy or status\n");
+      return -1;
+  }
+
+  if (params->dies < 1 || params->dies > DIE_MAX)
+  {
+      fprintf(stderr, "-D (dies) must be between 1 and %d\n", DIE_MAX);
+      return -1;
+  }
+
+  if (params->sample_rate < 0 || params->latency_ms < 0 || params->latency_ms > 255
+      || params->chunk_size < 0)
+  {
+      fprintf(stderr, "-r (sample rate) and -x (chunk size) must be positive, "
+                      "-l (latency) between 1 and 255\n");
+      return -1;
+  }
+
+  if (params->calibrate && (params->do_program || params->do_erase || params->test))
+  {
+      fprintf(stderr, "-C (calibrate) only reads, it can't be combined with -p, -E or -t\n");
+      return -1;
+  }
+
+  if (params->do_move && (params->do_program || params->do_erase || params->test
+                          || params->calibrate))
+  {
+      fprintf(stderr, "-m (move) can't be combined with -p, -E, -t or -C\n");
+      return -1;
+  }
+
+  if (params->do_scan && (params->do_program || params->do_erase || params->do_move
+                          || params->test || params->calibrate || params->window))
+  {
+      fprintf(stderr, "-B (bad block scan) can't be combined with -p, -E, -m, -t, -C or -w\n");
+      return -1;
+  }
+
+  if (params->logical && (params->do_erase || params->do_move || params->do_scan
+                          || params->test || params->calibrate))
+  {
+      fprintf(stderr, "-L (logical image) is for dumps and -p only\n");
+      return -1;
+  }
+
+  if (params->do_sync && (params->do_program || params->do_erase || params->do_move
+                          || params->do_scan || params->logical || params->test
+                          || params->calibrate || params->window))
+  {
+      fprintf(stderr, "-y (sync) can't be combined with -p, -E, -m, -B, -L, -t, -C or -w\n");
+      return -1;
+  }
+
+  if (params->verify && !params->do_program && !params->do_sync)
+  {
+      fprintf(stderr, "-V (verify) only goes with -p or -y\n");
+      return -1;
+  }
+
+  if (params->blank_check && !params->do_erase)
+  {
+      fprintf(stderr, "-z (blank check) only goes with -E\n");
+      return -1;
+  }
+
+  if (params->patch_file && !params->do_move)
+  {
+      fprintf(stderr, "-P (patch file) only applies to -m (move)\n");
+      return -1;
+  }
+
+  if (params->window
+      && (params->do_program || params->do_erase || params->do_move || params->test
+          || params->calibrate))
   {
-      params->start_page = params->start_block * PAGE_PER_BLOCK;
+      fprintf(stderr, "-w (window) only applies to dumps\n");
+      return -1;
   }
 
   for (index = optind; index < argc; index++)
@@ -248,576 +596,3248 @@ int parse_prog_params(prog_params_t *params, int argc, char **argv)
   return 0;
 }
 
-void inline _usleep(int delay_us)
+/*
+ * Bus backends.
+ *
+ * Everything above the latch_* functions talks to the NAND through a
+ * nand_bus_t, and a backend (bus_ops_t) decides how the bus actually moves.
+ * The pin level operations are what the latch_* functions are written
+ * against:
+ *  - set_pins: drive a value on the I/O or control bus (may be queued)
+ *  - read_pins: sample the I/O or control bus
+ *  - set_direction: switch the I/O bus between driving and sampling
+ *  - flush: push out queued updates; with wait set, also wait until they,
+ *    and any deferred reads, are done
+ *  - sleep, now: time as the backend sees it, in usec (optional, the default
+ *    is the host's clock); simulators run on a virtual one
+ *  - pad: keep a channel as it is for at least ns nanoseconds, as part of
+ *    the bus stream (optional, see bus_hold())
+ *  - serial: USB serial number of the device, for link profiles (optional)
+ *
+ * Backends whose hardware generates the nWE/nRE strobes itself (host bus
+ * emulation, simulators) can't move single pins: they leave set_pins NULL
+ * and provide write_cycles (latch is PIN_CLE for commands, PIN_ALE for
+ * addresses and 0 for data) and read_cycles, which the latch_* functions use
+ * when present. A pin level backend may also provide read_cycles, to read
+ * data in bulk.
+ */
+typedef struct _bus_ops {
+    const char *name;
+    int (*open)(nand_bus_t *bus, prog_params_t *params);
+    void (*close)(nand_bus_t *bus);
+    void (*set_pins)(nand_bus_t *bus, bus_chan_t chan, unsigned char value);
+    unsigned char (*read_pins)(nand_bus_t *bus, bus_chan_t chan);
+    void (*set_direction)(nand_bus_t *bus, iobus_inout_t inout);
+    int (*flush)(nand_bus_t *bus, int wait);
+    void (*sleep)(nand_bus_t *bus, unsigned int us);
+    unsigned long long (*now)(nand_bus_t *bus);
+    void (*pad)(nand_bus_t *bus, bus_chan_t chan, unsigned int ns);
+    const char *(*serial)(nand_bus_t *bus);
+    int (*write_cycles)(nand_bus_t *bus, unsigned char latch, unsigned char data[],
+                        unsigned int length);
+    int (*read_cycles)(nand_bus_t *bus, unsigned char data[], unsigned int length,
+                       int deferred);
+} bus_ops_t;
+
+struct _nand_bus {
+    const bus_ops_t *ops;
+    unsigned char iobus_value;
+    unsigned char controlbus_value;
+    int delay;         /* extra delay after edges, in usec (-d) */
+    int batching;      /* 0: push every update right away (-u) */
+    int dies;          /* chips on the bus, see die_select() */
+    usb_stats_t stats;
+    void *priv;        /* backend state */
+
+    /* bus state cache, see bus_set_pins() */
+    unsigned char pins[2];     /* last value put on each channel */
+    int pins_valid;            /* bit per channel: pins[] is known */
+    iobus_inout_t iobus_dir;   /* direction the I/O bus is in */
+    int iobus_dir_valid;
+    int iobus_out_pending;     /* switch the I/O bus to output on the next write */
+};
+
+int bus_flush(nand_bus_t *bus)
+{
+    return bus->ops->flush(bus, 0);
+}
+
+/* Flush and wait until everything, deferred reads included, is done */
+int bus_sync(nand_bus_t *bus)
+{
+    return bus->ops->flush(bus, 1);
+}
+
+/* Sleeping only makes sense once the pending pin updates are on the wire */
+void bus_usleep(nand_bus_t *bus, int delay_us)
 {
     if (delay_us)
     {
-        usleep(delay_us);
+        bus_sync(bus);
+        if (bus->ops->sleep)
+            bus->ops->sleep(bus, delay_us);
+        else
+            usleep(delay_us);
     }
 }
 
-void controlbus_reset_value()
+/*
+ * Pauses of the tool itself, outside any NAND operation (power up, before
+ * exit): a real rig needs them, a simulated chip doesn't, and keeping them
+ * off its clock leaves the simulated time and throughput to the operations
+ */
+void bus_settle(nand_bus_t *bus, int delay_us)
 {
-    controlbus_value = 0x00;
+    if (bus->ops->now)
+    {
+        bus_sync(bus);
+        return;
+    }
+    bus_usleep(bus, delay_us);
 }
 
-void controlbus_pin_set(unsigned char pin, onoff_t val)
+unsigned long long bus_now_us(nand_bus_t *bus)
 {
-    if (val == ON)
-        controlbus_value |= pin;
-    else
-        controlbus_value &= (unsigned char)0xFF ^ pin;
+    struct timespec ts;
+
+    if (bus->ops->now)
+    {
+        return bus->ops->now(bus);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-void controlbus_update_output()
+/* Snapshot of the counters, for print_usb_stats() */
+usb_stats_t bus_stats(nand_bus_t *bus)
 {
-    unsigned char buf[1]; /* buffer for FTDI function needs to be an array */
-    buf[0] = controlbus_value;
-    ftdi_write_data(nandflash_controlbus, buf, 1);
+    usb_stats_t stats = bus->stats;
+    stats.time_us = bus_now_us(bus);
+    return stats;
 }
 
-void test_controlbus()
+/*
+ * NAND bus timings, minimum values in ns (TC58NVG1S3H data sheet).
+ *
+ * Every edge the latch_* functions make is followed by bus_hold() for the
+ * phase it starts. Backends turn the hold into padding in the bus stream
+ * (repeated samples at the bit-bang rate, repeated MPSSE commands), so a
+ * setup or hold margin costs wire time instead of a sleep; the phases
+ * shorter than one update cost nothing. -d n raises every phase to at
+ * least n usec. Unbatched I/O (-u) keeps the old behaviour of sleeping -d
+ * usec after the edge.
+ */
+typedef enum {
+    T_CLS, /* CLE setup, to nWE rising */
+    T_ALS, /* ALE setup, to nWE rising */
+    T_WP,  /* nWE pulse width */
+    T_WH,  /* nWE high hold */
+    T_DS,  /* data setup, to nWE rising */
+    T_RP,  /* nRE pulse width */
+    T_REA, /* nRE access time, nRE falling to data valid */
+    T_REH, /* nRE high hold */
+    T_CCS, /* change column setup, E0h to data output */
+    T_PHASES
+} nand_phase_t;
+
+const unsigned int nand_timing_ns[T_PHASES] = {
+    [T_CLS] = 12,
+    [T_ALS] = 12,
+    [T_WP]  = 12,
+    [T_WH]  = 10,
+    [T_DS]  = 12,
+    [T_RP]  = 12,
+    [T_REA] = 20,
+    [T_REH] = 10,
+    [T_CCS] = 500,
+};
+
+void bus_hold(nand_bus_t *bus, bus_chan_t chan, nand_phase_t phase)
 {
-    #define CONTROLBUS_TEST_DELAY 1000000 /* 1 sec */
+    unsigned int ns = nand_timing_ns[phase];
 
-    printf("  CLE on\n");
-    controlbus_pin_set(PIN_CLE, ON);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+    if (!bus->batching || !bus->ops->pad)
+    {
+        bus_usleep(bus, bus->delay);
+        return;
+    }
 
-    printf("  ALE on\n");
-    controlbus_pin_set(PIN_ALE, ON);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+    if (bus->delay * 1000 > (int)ns)
+    {
+        ns = bus->delay * 1000;
+    }
+    bus->ops->pad(bus, chan, ns);
+}
 
-    printf("  nCE on\n");
-    controlbus_pin_set(PIN_nCE, ON);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+/* Extra updates needed to hold a value for ns, the update itself counting as one */
+unsigned int bus_pad_count(unsigned int ns, unsigned long update_ns)
+{
+    unsigned int count = (ns + update_ns - 1) / update_ns;
+    return count ? count - 1 : 0;
+}
 
-    printf("  nWE on\n");
-    controlbus_pin_set(PIN_nWE, ON);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+void print_usb_stats(nand_bus_t *bus, usb_stats_t *start, unsigned int pages)
+{
+    usb_stats_t *stats = &bus->stats;
+    unsigned long writes = stats->writes - start->writes;
+    unsigned long reads = stats->reads - start->reads;
+    unsigned long bulk_reads = stats->bulk_reads - start->bulk_reads;
+    unsigned long bitmodes = stats->bitmodes - start->bitmodes;
+    unsigned long total = writes + reads + bulk_reads + bitmodes;
+    double secs = (bus_now_us(bus) - start->time_us) / 1e6;
+
+    printf("USB transfers: %lu (%.1f per page): %lu writes (%lu bytes), "
+           "%lu pin reads, %lu bulk reads, %lu bitmode changes\n",
+           total, pages ? (float)total / pages : 0.0f,
+           writes, stats->bytes - start->bytes, reads, bulk_reads, bitmodes);
+    printf("Time: %.3f s (%.1f pages/s)\n", secs, secs > 0 ? pages / secs : 0.0);
+}
 
+void controlbus_reset_value(nand_bus_t *bus)
+{
+    bus->controlbus_value = 0x00;
+}
 
-    printf("  nRE on\n");
-    controlbus_pin_set(PIN_nRE, ON);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+void controlbus_pin_set(nand_bus_t *bus, unsigned char pin, onoff_t val)
+{
+    if (val == ON)
+        bus->controlbus_value |= pin;
+    else
+        bus->controlbus_value &= (unsigned char)0xFF ^ pin;
+}
 
-    printf("  nWP on\n");
-    controlbus_pin_set(PIN_nWP, ON);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+/*
+ * Dies: chips sharing the bus, each with its own nCE. The first one's is
+ * PIN_nCE, the second one's takes the LED pin. Pages and blocks of a die
+ * come after the previous die's; addresses sent to the chip are within the
+ * die (see get_address_cycle_map_x8_toshiba_page()).
+ */
+static const unsigned char die_nce_pins[DIE_MAX] = { PIN_nCE, PIN_nCE2 };
 
-    printf("  LED on\n");
-    controlbus_pin_set(PIN_LED, ON);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+/* Select a die, or none with DIE_NONE; like controlbus_pin_set(), the pins
+ * only move on the next controlbus_update_output() */
+void die_select(nand_bus_t *bus, int die)
+{
+    for (int d = 0; d < bus->dies; d++)
+    {
+        controlbus_pin_set(bus, die_nce_pins[d], d == die ? OFF : ON);
+    }
+}
 
+/* Part of [first, first + count) that is on die, in pages or blocks */
+unsigned int die_range(int die, unsigned int per_die, unsigned int first,
+                       unsigned int count, unsigned int *die_first)
+{
+    unsigned int lo = die * per_die;
+    unsigned int hi = lo + per_die;
+    unsigned int start = first > lo ? first : lo;
+    unsigned int end = first + count < hi ? first + count : hi;
 
-    printf("  CLE off\n");
-    controlbus_pin_set(PIN_CLE, OFF);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+    *die_first = start;
+    return start < end ? end - start : 0;
+}
 
-    printf("  ALE off\n");
-    controlbus_pin_set(PIN_ALE, OFF);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+int die_selected(nand_bus_t *bus)
+{
+    for (int d = 0; d < bus->dies; d++)
+    {
+        if (~bus->controlbus_value & die_nce_pins[d])
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    printf("  nCE off\n");
-    controlbus_pin_set(PIN_nCE, OFF);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+/*
+ * Bus state cache.
+ *
+ * The bus remembers what it last put on each channel and which way the I/O
+ * bus points, and drops updates that would change nothing: a repeated I/O
+ * value between nWE edges (address bytes, runs of equal data bytes) or a
+ * direction switch to where the bus already is. Turning the I/O bus back
+ * into an output after a read is deferred until something is written on
+ * it, so back-to-back reads (status polls, ID) don't flip it at all; while
+ * it is an input the NAND only drives it with nRE low, so nothing fights.
+ *
+ * Backends that move the pins behind the cache's back (sample strobes)
+ * call bus_invalidate(). Unbatched I/O (-u) bypasses the cache.
+ */
+void bus_invalidate(nand_bus_t *bus, bus_chan_t chan)
+{
+    bus->pins_valid &= ~(1 << chan);
+}
 
-    printf("  nWE off\n");
-    controlbus_pin_set(PIN_nWE, OFF);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+void bus_set_pins(nand_bus_t *bus, bus_chan_t chan, unsigned char value)
+{
+    if (!bus->ops->set_pins)
+    {
+        return;
+    }
 
-    printf("  nRE off\n");
-    controlbus_pin_set(PIN_nRE, OFF);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+    if (bus->batching && (bus->pins_valid & (1 << chan)) && bus->pins[chan] == value)
+    {
+        return;
+    }
 
-    printf("  nWP off\n");
-    controlbus_pin_set(PIN_nWP, OFF);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+    bus->ops->set_pins(bus, chan, value);
+    bus->pins[chan] = value;
+    bus->pins_valid |= 1 << chan;
+}
 
-    printf("  LED off\n");
-    controlbus_pin_set(PIN_LED, OFF);
-    controlbus_update_output(nandflash_controlbus);
-    _usleep(CONTROLBUS_TEST_DELAY);
+void bus_apply_direction(nand_bus_t *bus, iobus_inout_t inout)
+{
+    bus->iobus_out_pending = 0;
+
+    if (bus->batching && bus->iobus_dir_valid && bus->iobus_dir == inout)
+    {
+        return;
+    }
+
+    if (bus->ops->set_direction)
+    {
+        bus->ops->set_direction(bus, inout);
+        /* some backends resend the I/O value along with the direction */
+        bus_invalidate(bus, CHAN_IOBUS);
+    }
+    bus->iobus_dir = inout;
+    bus->iobus_dir_valid = 1;
 }
 
-void iobus_set_direction(iobus_inout_t inout)
+void controlbus_update_output(nand_bus_t *bus)
 {
-    if (inout == IOBUS_OUT)
-        ftdi_set_bitmode(nandflash_iobus, IOBUS_BITMASK_WRITE, BITMODE_BITBANG);
-    else if (inout == IOBUS_IN)
-        ftdi_set_bitmode(nandflash_iobus, IOBUS_BITMASK_READ, BITMODE_BITBANG);        
+    bus_set_pins(bus, CHAN_CONTROLBUS, bus->controlbus_value);
 }
 
-void iobus_reset_value()
+unsigned char controlbus_read_input(nand_bus_t *bus)
 {
-    iobus_value = 0x00;
+    return bus->ops->read_pins(bus, CHAN_CONTROLBUS);
 }
 
-void iobus_pin_set(unsigned char pin, onoff_t val)
+void iobus_set_direction(nand_bus_t *bus, iobus_inout_t inout)
 {
-    if (val == ON)
-        iobus_value |= pin;
-    else
-        iobus_value &= (unsigned char)0xFF ^ pin;
+    if (inout == IOBUS_OUT && bus->batching)
+    {
+        bus->iobus_out_pending = 1;
+        return;
+    }
+
+    bus_apply_direction(bus, inout);
 }
 
-void iobus_set_value(unsigned char value)
+void iobus_reset_value(nand_bus_t *bus)
 {
-    iobus_value = value;
+    bus->iobus_value = 0x00;
 }
 
-void iobus_update_output()
+void iobus_pin_set(nand_bus_t *bus, unsigned char pin, onoff_t val)
 {
-    unsigned char buf[1]; /* buffer for FTDI function needs to be an array */
-    buf[0] = iobus_value;
-    ftdi_write_data(nandflash_iobus, buf, 1);
+    if (val == ON)
+        bus->iobus_value |= pin;
+    else
+        bus->iobus_value &= (unsigned char)0xFF ^ pin;
 }
 
-unsigned char iobus_read_input()
+void iobus_set_value(nand_bus_t *bus, unsigned char value)
 {
-    unsigned char buf; 
-    //ftdi_read_data(nandflash_iobus, buf, 1); /* buffer for FTDI function needed to be an array */
-    ftdi_read_pins(nandflash_iobus, &buf);
-    return buf;
+    bus->iobus_value = value;
 }
 
-unsigned char controlbus_read_input()
+void iobus_update_output(nand_bus_t *bus)
 {
-    unsigned char buf;
-    //ftdi_read_data(nandflash_controlbus, buf, 1); /* buffer for FTDI function needed to be an array */
-    ftdi_read_pins(nandflash_controlbus, &buf);
-    return buf;
+    if (bus->iobus_out_pending)
+    {
+        bus_apply_direction(bus, IOBUS_OUT);
+    }
+
+    bus_set_pins(bus, CHAN_IOBUS, bus->iobus_value);
 }
 
+unsigned char iobus_read_input(nand_bus_t *bus)
+{
+    return bus->ops->read_pins(bus, CHAN_IOBUS);
+}
 
-void test_iobus()
+/*
+ * Data output one byte at a time through the pins: nRE low, sample the I/O
+ * bus, nRE high. The fallback for latch_register() when a backend has no
+ * read_cycles, or when it can't do better for a given read.
+ */
+int bus_read_by_pins(nand_bus_t *bus, unsigned char reg[], unsigned int reg_length)
 {
-    #define IOBUS_TEST_DELAY 1000000 /* 1 sec */
+    iobus_set_direction(bus, IOBUS_IN);
 
-    printf("  DIO0 on\n");
-    iobus_pin_set(PIN_DIO0, ON);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
+    for (unsigned int addr_idx = 0; addr_idx < reg_length; addr_idx++)
+    {
+        /* toggle nRE low; acts like a clock to latch out the data;
+         * data is valid tREA after the falling edge of nRE
+         * (also increments the internal column address counter by one) */
+        controlbus_pin_set(bus, PIN_nRE, OFF);
+        controlbus_update_output(bus);
+        bus_hold(bus, CHAN_CONTROLBUS, T_REA);
 
-    printf("  DIO1 on\n");
-    iobus_pin_set(PIN_DIO1, ON);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
+        // read I/O pins
+        reg[addr_idx] = iobus_read_input(bus);
 
-    printf("  DIO2 on\n");
-    iobus_pin_set(PIN_DIO2, ON);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
+        // toggle nRE back high
+        controlbus_pin_set(bus, PIN_nRE, ON);
+        controlbus_update_output(bus);
+        bus_hold(bus, CHAN_CONTROLBUS, T_REH);
+    }
 
-    printf("  DIO3 on\n");
-    iobus_pin_set(PIN_DIO3, ON);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
+    iobus_set_direction(bus, IOBUS_OUT);
 
-    printf("  DIO4 on\n");
-    iobus_pin_set(PIN_DIO4, ON);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
+    return 0;
+}
 
-    printf("  DIO5 on\n");
-    iobus_pin_set(PIN_DIO5, ON);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
+/*
+ * FTDI link, shared by the FT2232H backends (bitbang, mpsse, mcu).
+ *
+ * Bus transaction queue: pin updates for both channels are queued in order
+ * and pushed out by link_flush() as one ftdi_write_data() per run of
+ * consecutive updates to the same channel. Runs are written one after the
+ * other, so the edge ordering between the I/O bus and the control bus is
+ * kept: a run is only handed to the chip once the run before it (on the
+ * other channel) has been. The chip clocks a run out at the bit-bang rate,
+ * which is much quicker than the next USB round trip, so runs don't overlap
+ * on the wire. The single channel engines (mpsse, mcu) queue their MPSSE
+ * commands on the I/O bus channel, so a flush is one command stream.
+ *
+ * Anything that looks at the pins (reads, direction changes, waiting on
+ * RDY) or sleeps must flush first.
+ */
+#define BUS_TXN_MAX 16384
 
-    printf("  DIO6 on\n");
-    iobus_pin_set(PIN_DIO6, ON);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
+typedef struct _bus_txn {
+    int len;
+    unsigned char chan[BUS_TXN_MAX];  /* bus_chan_t of each queued value */
+    unsigned char value[BUS_TXN_MAX];
+} bus_txn_t;
 
-    printf("  DIO7 on\n");
-    iobus_pin_set(PIN_DIO7, ON);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
-
-
-    iobus_pin_set(PIN_DIO0, OFF);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
-
-    iobus_pin_set(PIN_DIO1, OFF);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
-
-    iobus_pin_set(PIN_DIO2, OFF);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
-
-    iobus_pin_set(PIN_DIO3, OFF);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
-
-    iobus_pin_set(PIN_DIO4, OFF);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
-
-    iobus_pin_set(PIN_DIO5, OFF);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
-
-    iobus_pin_set(PIN_DIO6, OFF);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
-
-    iobus_pin_set(PIN_DIO7, OFF);
-    iobus_update_output(nandflash_iobus);
-    _usleep(IOBUS_TEST_DELAY);
-
-    _usleep(5 * IOBUS_TEST_DELAY);
-    iobus_set_value(0xFF);
-    iobus_update_output();
-    _usleep(5 * IOBUS_TEST_DELAY);
-    iobus_set_value(0xAA);
-    iobus_update_output();
-    _usleep(5 * IOBUS_TEST_DELAY);
-    iobus_set_value(0x55);
-    iobus_update_output();
-    _usleep(5 * IOBUS_TEST_DELAY);
-    iobus_set_value(0x00);
-    iobus_update_output();
-
-    
-    iobus_pin_set(PIN_DIO0, ON);
-    iobus_pin_set(PIN_DIO2, ON);
-    iobus_pin_set(PIN_DIO4, ON);
-    iobus_pin_set(PIN_DIO6, ON);
-    iobus_update_output(nandflash_iobus);
-    _usleep(2* 100000);
+/*
+ * Asynchronous USB submission.
+ *
+ * With -a n, writes are handed to ftdi_write_data_submit() and link_write()
+ * returns right away, with up to n transfers kept in flight; when the queue
+ * is full the oldest transfer is waited for first. Transfers on one channel
+ * complete in submission order. Before a transfer goes to the other channel,
+ * or before anything synchronous (pin reads, bitmode changes, sleeps), all
+ * transfers in flight are waited for with bus_sync(), so ordering is exactly
+ * that of synchronous I/O.
+ *
+ * Deferred reads (latch_register_deferred()) go through the same queue with
+ * ftdi_read_data_submit(); their data is only valid after the next
+ * bus_sync(). This lets dump_memory() write page N-1 to its file, and
+ * program_file() read page N+1 from its file, while page N is on the wire.
+ *
+ * Only the single channel engines (mpsse, mcu) get any real overlap; the
+ * bitbang engine alternates channels on every edge.
+ */
+typedef struct _async_slot {
+    struct ftdi_transfer_control *tc;
+    unsigned char *buf; /* copy of the written data, owned until completion */
+} async_slot_t;
+
+typedef struct _usb_async {
+    int depth;                 /* max transfers in flight, 0: synchronous */
+    int head;                  /* oldest transfer in flight */
+    int count;
+    struct ftdi_context *ftdi; /* channel the transfers in flight are on */
+    async_slot_t slots[ASYNC_MAX_DEPTH];
+} usb_async_t;
+
+#define LINK_SERIAL_MAX 64
+
+typedef struct _ftdi_link {
+    struct ftdi_context *iobus;      /* channel A */
+    struct ftdi_context *controlbus; /* channel B, or channel A for single channel engines */
+    unsigned char iobus_dir;         /* I/O bus direction mask (mpsse) */
+    unsigned long update_ns;         /* time one bit-bang update holds the pins */
+    int syncbb;                      /* channel A is in sync bit-bang mode (bitbang) */
+    int latency_ms;                  /* latency timer and chunk size of both channels */
+    int chunk_size;
+    char serial[LINK_SERIAL_MAX];    /* USB serial number, keys the link profile */
+    bus_txn_t txn;
+    usb_async_t async;
+} ftdi_link_t;
+
+/*
+ * Synchronous bit-bang reads.
+ *
+ * In BITMODE_SYNCBB every byte written to a channel clocks one sample of its
+ * pins into the receive FIFO. Reading a run of bytes from the I/O bus then
+ * becomes bulk writes of dummy "strobe" bytes and one bulk read per chunk,
+ * instead of one ftdi_read_pins() control transfer per byte.
+ *
+ * nRE lives on the other channel, so strobes and nRE edges still alternate
+ * between the two channels through the transaction queue, which keeps them
+ * in order. Each byte is sampled SYNCBB_SAMPLES_PER_BYTE times and only the
+ * last sample, the one furthest from the nRE falling edge, is kept.
+ *
+ * The MPSSE engine samples with a GET_BITS_LOW command instead, queued in
+ * the same command stream as the nRE edges; the MPSSE takes longer to decode
+ * a command than tREA, so one sample per byte is enough there.
+ */
+#define SYNCBB_SAMPLES_PER_BYTE 2
+#define SYNCBB_CHUNK 256      /* bytes per read back, keeps well clear of the 4 KiB RX FIFO */
+#define SYNCBB_MIN_LENGTH 16  /* shorter reads (status, ID) use plain pin reads */
+#define SYNCBB_READ_RETRIES 1000
+#define MPSSE_CHUNK 3072      /* GET_BITS_LOW replies per read back, a whole page */
+
+/* Wait for the oldest transfer in flight */
+int usb_async_wait_one(usb_async_t *async)
+{
+    async_slot_t *slot = &async->slots[async->head];
+    int ret = ftdi_transfer_data_done(slot->tc);
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "async USB transfer failed: %d (%s)\n", ret,
+                ftdi_get_error_string(async->ftdi));
+    }
 
+    free(slot->buf);
+    slot->buf = NULL;
+    slot->tc = NULL;
+    async->head = (async->head + 1) % ASYNC_MAX_DEPTH;
+    async->count--;
+
+    return ret < 0 ? ret : 0;
 }
 
-/* 
- * "Command Input bus operation is used to give a command to the memory device.
- *  Command are accepted with Chip Enable low, Command Latch Enable High, 
- *  Address Latch Enable low and Read Enable High and latched on the rising
- *  edge of Write Enable. Moreover for commands that starts a modify operation
- *  (write/erase) the Write Protect pin must be high."
-*/
-int latch_command(prog_params_t *params, unsigned char command)
+int usb_async_wait_all(usb_async_t *async)
 {
-    /* check if ALE is low and nRE is high */
-    if (controlbus_value & PIN_nCE)
+    int ret = 0;
+    while (async->count)
     {
-        fprintf(stderr, "latch_command requires nCE pin to be low\n");
-        return EXIT_FAILURE;
+        if (usb_async_wait_one(async))
+        {
+            ret = -1;
+        }
     }
-    else if (~controlbus_value & PIN_nRE)
+    return ret;
+}
+
+/*
+ * Queue a submitted transfer; owned_buf is freed once the transfer is done
+ * (NULL for reads into the caller's buffer).
+ */
+int usb_async_push(usb_async_t *async, struct ftdi_context *ftdi,
+                   struct ftdi_transfer_control *tc, unsigned char *owned_buf)
+{
+    if (tc == NULL)
     {
-        fprintf(stderr, "latch_command requires nRE pin to be high\n");
-        return EXIT_FAILURE;
+        fprintf(stderr, "async USB submit failed (%s)\n", ftdi_get_error_string(ftdi));
+        free(owned_buf);
+        return -1;
     }
 
-    DBG("latch_command(0x%02X)\n", command);
-
-    /* toggle CLE high (activates the latching of the IO inputs inside the 
-     * Command Register on the Rising edge of nWE) */
-    DBGFLUSH("  setting CLE high,");
-    controlbus_pin_set(PIN_CLE, ON);
-    controlbus_update_output();
-
-    // toggle nWE low
-    DBGFLUSH(" nWE low,");
-    controlbus_pin_set(PIN_nWE, OFF);
-    controlbus_update_output();
-
-    // change I/O pins
-    DBGFLUSH(" I/O bus to command,");
-    iobus_set_value(command);
-    iobus_update_output();
-
-    // toggle nWE back high (acts as clock to latch the command!)
-    DBGFLUSH(" nWE high,");
-    controlbus_pin_set(PIN_nWE, ON);
-    controlbus_update_output();
-
-    // toggle CLE low
-    DBG(" CLE low\n");
-    controlbus_pin_set(PIN_CLE, OFF);
-    controlbus_update_output();
-
+    int tail = (async->head + async->count) % ASYNC_MAX_DEPTH;
+    async->slots[tail].tc = tc;
+    async->slots[tail].buf = owned_buf;
+    async->count++;
+    async->ftdi = ftdi;
     return 0;
 }
 
-/** 
- * "Address Input bus operation allows the insertion of the memory address. 
- * Five cycles are required to input the addresses for the 4Gbit devices. 
- * Addresses are accepted with Chip Enable low, Address Latch Enable High, 
- * Command Latch Enable low and Read Enable High and latched on the rising 
- * edge of Write Enable. 
- * 
- * Moreover for commands that starts a modifying operation (write/erase) 
- * the Write Protect pin must be high. See Figure 5 and Table 13 for details 
- * of the timings requirements. 
- * 
- * Addresses are always applied on IO7:0 regardless of the bus configuration 
- * (x8 or x16)."
- */
-int latch_address(prog_params_t *params, unsigned char address[], unsigned int addr_length)
+/* Make room for a transfer on ftdi, keeping the ordering rules above */
+void usb_async_reserve(usb_async_t *async, struct ftdi_context *ftdi)
 {
-    unsigned int addr_idx = 0;
-
-    /* check if ALE is low and nRE is high */
-    if (controlbus_value & PIN_nCE)
+    if (async->count && async->ftdi != ftdi)
     {
-        fprintf(stderr, "latch_address requires nCE pin to be low\n");
-        return EXIT_FAILURE;
+        usb_async_wait_all(async);
     }
-    else if (controlbus_value & PIN_CLE)
+    while (async->count >= async->depth)
     {
-        fprintf(stderr, "latch_address requires CLE pin to be low\n");
-        return EXIT_FAILURE;
+        usb_async_wait_one(async);
     }
-    else if (~controlbus_value & PIN_nRE)
+}
+
+void link_write(nand_bus_t *bus, struct ftdi_context *ftdi, unsigned char *buf, int len)
+{
+    ftdi_link_t *link = bus->priv;
+
+    /* libftdi splits large writes into chunks, one bulk transfer each */
+    bus->stats.writes += (len + ftdi->writebuffer_chunksize - 1) / ftdi->writebuffer_chunksize;
+    bus->stats.bytes += len;
+
+    if (!link->async.depth)
     {
-        fprintf(stderr, "latch_address requires nRE pin to be high\n");
-        return EXIT_FAILURE;
+        ftdi_write_data(ftdi, buf, len);
+        return;
     }
 
-    /* toggle ALE high (activates the latching of the IO inputs inside
-     * the Address Register on the Rising edge of nWE. */
-    controlbus_pin_set(PIN_ALE, ON);
-    controlbus_update_output();
+    unsigned char *copy = malloc(len);
+    if (copy == NULL)
+    {
+        fprintf(stderr, "malloc error, size=%d\n", len);
+        usb_async_wait_all(&link->async);
+        ftdi_write_data(ftdi, buf, len);
+        return;
+    }
+    memcpy(copy, buf, len);
 
-    for (addr_idx = 0; addr_idx < addr_length; addr_idx++)
+    usb_async_reserve(&link->async, ftdi);
+    usb_async_push(&link->async, ftdi, ftdi_write_data_submit(ftdi, copy, len), copy);
+}
+
+void link_flush(nand_bus_t *bus)
+{
+    ftdi_link_t *link = bus->priv;
+    bus_txn_t *txn = &link->txn;
+    int start = 0;
+
+    while (start < txn->len)
     {
-        // toggle nWE low
-        controlbus_pin_set(PIN_nWE, OFF);
-        controlbus_update_output();
-        _usleep(params->delay);
+        int end = start + 1;
+        while (end < txn->len && txn->chan[end] == txn->chan[start])
+        {
+            end++;
+        }
 
-        // change I/O pins
-        iobus_set_value(address[addr_idx]);
-        iobus_update_output();
-        _usleep(params->delay); /* TODO: assure setup delay */
+        link_write(bus, txn->chan[start] == CHAN_IOBUS ? link->iobus : link->controlbus,
+                   &txn->value[start], end - start);
+        start = end;
+    }
+    txn->len = 0;
+}
 
-        // toggle nWE back high (acts as clock to latch the current address byte!)
-        controlbus_pin_set(PIN_nWE, ON);
-        controlbus_update_output();
-        _usleep(params->delay); /* TODO: assure hold delay */
+void link_append(nand_bus_t *bus, bus_chan_t chan, unsigned char value)
+{
+    ftdi_link_t *link = bus->priv;
+    bus_txn_t *txn = &link->txn;
+
+    if (txn->len == BUS_TXN_MAX)
+    {
+        link_flush(bus);
     }
 
-    // toggle ALE low
-    controlbus_pin_set(PIN_ALE, OFF);
-    controlbus_update_output();
+    txn->chan[txn->len] = chan;
+    txn->value[txn->len] = value;
+    txn->len++;
+}
 
-    // wait for ALE to nRE Delay tAR before nRE is taken low (nanoseconds!)
+int ftdi_bus_flush(nand_bus_t *bus, int wait)
+{
+    ftdi_link_t *link = bus->priv;
 
-    return 0;
+    link_flush(bus);
+    return wait ? usb_async_wait_all(&link->async) : 0;
 }
 
-/* Data Output bus operation allows to read data from the memory array and to 
- * check the status register content, the EDC register content and the ID data.
- * Data can be serially shifted out by toggling the Read Enable pin with Chip 
- * Enable low, Write Enable High, Address Latch Enable low, and Command Latch 
- * Enable low. */
-int latch_register(prog_params_t *params, unsigned char reg[], unsigned int reg_length)
+/*
+ * Read back len samples from channel A. With deferred set and async I/O on,
+ * the read is only submitted and samples is filled in by the next bus_sync().
+ */
+int link_read_samples(nand_bus_t *bus, unsigned char *samples, int len, int deferred)
 {
-    unsigned int addr_idx = 0;
+    ftdi_link_t *link = bus->priv;
+    int got = 0;
+    int retries = 0;
 
-    /* check if ALE is low and nRE is high */
-    if (controlbus_value & PIN_nCE)
-    {
-        fprintf(stderr, "latch_address requires nCE pin to be low\n");
-        return EXIT_FAILURE;
-    }
-    else if (~controlbus_value & PIN_nWE)
+    if (deferred && link->async.depth)
     {
-        fprintf(stderr, "latch_address requires nWE pin to be high\n");
-        return EXIT_FAILURE;
+        link_flush(bus);
+        bus->stats.bulk_reads++;
+        usb_async_reserve(&link->async, link->iobus);
+        return usb_async_push(&link->async, link->iobus,
+                              ftdi_read_data_submit(link->iobus, samples, len), NULL);
     }
-    else if (controlbus_value & PIN_ALE)
+
+    bus_sync(bus);
+    while (got < len)
     {
-        fprintf(stderr, "latch_address requires ALE pin to be low\n");
-        return EXIT_FAILURE;
+        int ret = ftdi_read_data(link->iobus, samples + got, len - got);
+        bus->stats.bulk_reads++;
+        if (ret < 0)
+        {
+            fprintf(stderr, "sync bit-bang read failed: %d (%s)\n", ret,
+                    ftdi_get_error_string(link->iobus));
+            return -1;
+        }
+        else if (ret == 0 && ++retries > SYNCBB_READ_RETRIES)
+        {
+            fprintf(stderr, "sync bit-bang read timed out (%d/%d samples)\n", got, len);
+            return -1;
+        }
+        got += ret;
     }
 
-    iobus_set_direction(IOBUS_IN);
+    return 0;
+}
+
+/*
+ * Data output with the I/O bus sampled in bulk: every byte is nRE low,
+ * spb sample bytes queued on channel A, nRE high; the samples come back in
+ * chunks of max_chunk bytes, and the last sample of each byte is kept. With
+ * immediate set, a SEND_IMMEDIATE closes each chunk (MPSSE). Deferred reads
+ * only apply with one sample per byte, the samples are then the data.
+ */
+int link_read_cycles(nand_bus_t *bus, unsigned char reg[], unsigned int reg_length,
+                     int deferred, unsigned char sample, int spb,
+                     unsigned int max_chunk, int immediate)
+{
+    unsigned char samples[MPSSE_CHUNK > SYNCBB_CHUNK * SYNCBB_SAMPLES_PER_BYTE ?
+                          MPSSE_CHUNK : SYNCBB_CHUNK * SYNCBB_SAMPLES_PER_BYTE];
+    unsigned int done = 0;
 
-    for (addr_idx = 0; addr_idx < reg_length; addr_idx++)
+    while (done < reg_length)
     {
-        /* toggle nRE low; acts like a clock to latch out the data;
-         * data is valid tREA after the falling edge of nRE 
-         * (also increments the internal column address counter by one) */
-        controlbus_pin_set(PIN_nRE, OFF);
-        controlbus_update_output();
-        _usleep(params->delay);
+        unsigned int chunk = reg_length - done;
+        if (chunk > max_chunk)
+        {
+            chunk = max_chunk;
+        }
 
-        // read I/O pins
-        reg[addr_idx] = iobus_read_input();
+        for (unsigned int k = 0; k < chunk; k++)
+        {
+            /* toggle nRE low; data is valid tREA after the falling edge */
+            controlbus_pin_set(bus, PIN_nRE, OFF);
+            controlbus_update_output(bus);
+            bus_hold(bus, CHAN_CONTROLBUS, T_REA);
 
-        // toggle nRE back high
-        controlbus_pin_set(PIN_nRE, ON);
-        controlbus_update_output();
-        _usleep(params->delay);
-    }
+            // sample I/O pins
+            for (int s = 0; s < spb; s++)
+            {
+                link_append(bus, CHAN_IOBUS, sample);
+            }
+
+            // toggle nRE back high
+            controlbus_pin_set(bus, PIN_nRE, ON);
+            controlbus_update_output(bus);
+            bus_hold(bus, CHAN_CONTROLBUS, T_REH);
+        }
+
+        if (immediate)
+        {
+            /* don't let the replies wait for the latency timer */
+            link_append(bus, CHAN_IOBUS, SEND_IMMEDIATE);
+        }
 
-    iobus_set_direction(IOBUS_OUT);
+        if (deferred && spb == 1)
+        {
+            if (link_read_samples(bus, reg + done, chunk, deferred))
+            {
+                return EXIT_FAILURE;
+            }
+            done += chunk;
+            continue;
+        }
+
+        if (link_read_samples(bus, samples, chunk * spb, 0))
+        {
+            return EXIT_FAILURE;
+        }
+
+        for (unsigned int k = 0; k < chunk; k++)
+        {
+            reg[done + k] = samples[(k + 1) * spb - 1];
+        }
+        done += chunk;
+    }
 
     return 0;
 }
 
-void check_ID_register(unsigned char* ID_register)
-{
-    unsigned char ID_register_exp[5] = { 0xAD, 0xDC, 0x10, 0x95, 0x54 };
-
-    /* output the retrieved ID register content */
-    printf("actual ID register:   0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
-        ID_register[0], ID_register[1], ID_register[2],
-        ID_register[3], ID_register[4] ); 
+/*
+ * Link profiles.
+ *
+ * The fastest settings that still read back clean depend on the host, hub
+ * and cable, so -C measures them (see calibrate_link()) and saves them per
+ * device serial number and engine, one line each in ~/PROFILE_FILE:
+ *
+ *   <serial> <engine> <sample rate> <latency timer ms> <chunk size>
+ *
+ * Opening a link fills in whatever wasn't given on the command line from
+ * the matching line.
+ */
+#define PROFILE_FILE ".flash-tool-profiles"
+#define PROFILE_LINE_MAX 256
 
-    /* output the expected ID register content */
-    printf("expected ID register: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
-        ID_register_exp[0], ID_register_exp[1], ID_register_exp[2],
-        ID_register_exp[3], ID_register_exp[4] ); 
+/* Serial number of the FT2232H that ftdi_usb_open() will pick, the first one */
+int link_serial(char *serial, int len)
+{
+    struct ftdi_context *ftdi;
+    struct ftdi_device_list *devlist = NULL;
+    int ret = -1;
 
-    if (memcmp(ID_register_exp, ID_register, 5) == 0)
+    if ((ftdi = ftdi_new()) == NULL)
     {
-        printf("PASS: ID register did match\n");
+        return -1;
     }
-    else
+
+    if (ftdi_usb_find_all(ftdi, &devlist, FT2232H_VID, FT2232H_PID) > 0
+        && ftdi_usb_get_strings(ftdi, devlist->dev, NULL, 0, NULL, 0, serial, len) == 0
+        && serial[0])
     {
-        printf("FAIL: ID register did not match\n");
+        ret = 0;
     }
+
+    ftdi_list_free(&devlist);
+    ftdi_free(ftdi);
+    return ret;
 }
 
-/* 
- * Address Cycle Map calculations, for Toshiba TC58NVG1S3HTA00, page based.
- *
- * CA: Column Address (12 bits)
- * PA: Page Address 17 bits (6 bits page in block, 11 bits block address)
- *
- * NOTE: this will actually populate the 2nd byte (CA high) with all 8
- * bits (instead of 4), and the 5th byte (PA16..) with all 8 bits instead
- * of just 1 to let the function be more generalizable then the 2048*131072
- * configuration of the toshiba chip. If not acceptable, this function
- * should somehow fail instead of silently producing the wrong address
- * bytes.
- */
-void get_address_cycle_map_x8_toshiba_page(unsigned int page, 
-                                           unsigned int column, 
-                                           unsigned char* addr_cycles)
+void profile_path(char *path, size_t len)
 {
-    addr_cycles[0] = (unsigned char) ((column      ) & 0xFF); // CA0..CA7
-    addr_cycles[1] = (unsigned char) ((column >>  8) & 0xFF); // CA8..CA11 //NOTE
-    addr_cycles[2] = (unsigned char) ((page        ) & 0xFF); // PA0..PA7
-    addr_cycles[3] = (unsigned char) ((page   >>  8) & 0xFF); // PA8..PA15
-    addr_cycles[4] = (unsigned char) ((page   >> 16) & 0xFF); // PA16 // SEE NOTE
+    const char *home = getenv("HOME");
+    snprintf(path, len, "%s/%s", home ? home : ".", PROFILE_FILE);
 }
 
-/* Address Cycle Map calculations 
- *
- * NOTE(vm): this was the original address calculation. I swapped it
- * with the "_toshiba" one that's appropriate for the Toshiba TC58NVG1S3HTA00
- * chip I'm working with.
- */
-void get_address_cycle_map_x8(uint32_t mem_address, unsigned char* addr_cylces)
+int profile_load(prog_params_t *params, const char *serial)
 {
-    addr_cylces[0] = (unsigned char)(  mem_address & 0x000000FF);
-    addr_cylces[1] = (unsigned char)( (mem_address & 0x00000F00) >> 8 );
-    addr_cylces[2] = (unsigned char)( (mem_address & 0x000FF000) >> 12 );
-    addr_cylces[3] = (unsigned char)( (mem_address & 0x0FF00000) >> 20 );
-    addr_cylces[4] = (unsigned char)( (mem_address & 0x30000000) >> 28 );
+    char path[PATH_MAX];
+    char line[PROFILE_LINE_MAX];
+    char line_serial[LINK_SERIAL_MAX], engine[32];
+    int rate, latency, chunk;
+    FILE *f;
+
+    profile_path(path, sizeof(path));
+    if ((f = fopen(path, "r")) == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%63s %31s %d %d %d", line_serial, engine, &rate, &latency, &chunk) != 5
+            || strcmp(line_serial, serial) || strcmp(engine, params->engine))
+        {
+            continue;
+        }
+
+        printf("Using the link profile of %s (%s): sample rate %d, latency %d ms, chunk %d\n",
+               serial, engine, rate, latency, chunk);
+        if (!params->sample_rate)
+            params->sample_rate = rate;
+        if (!params->latency_ms)
+            params->latency_ms = latency;
+        if (!params->chunk_size)
+            params->chunk_size = chunk;
+        fclose(f);
+        return 0;
+    }
+
+    fclose(f);
+    return -1;
 }
 
-void wait_while_busy()
+/* Replace (or add) the line of this device and engine */
+int profile_save(prog_params_t *params, const char *serial)
 {
-    DBG("Checking for busy line...");
-    int loops = 0;
-    unsigned char controlbus_val;
-    do
+    char path[PATH_MAX], tmp_path[PATH_MAX + 4];
+    char line[PROFILE_LINE_MAX];
+    char line_serial[LINK_SERIAL_MAX], engine[32];
+    FILE *in, *out;
+
+    profile_path(path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.new", path);
+    if ((out = fopen(tmp_path, "w")) == NULL)
     {
-      if (loops)
-      {
-          DBGFLUSH(".");
-      }
-      loops++;
-      controlbus_val = controlbus_read_input();
+        fprintf(stderr, "Can't write link profiles to %s\n", tmp_path);
+        return -1;
     }
-    while (!(controlbus_val & PIN_RDY));
 
-    DBG("  done\n");
+    if ((in = fopen(path, "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), in))
+        {
+            if (sscanf(line, "%63s %31s", line_serial, engine) == 2
+                && !strcmp(line_serial, serial) && !strcmp(engine, params->engine))
+            {
+                continue;
+            }
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+
+    fprintf(out, "%s %s %d %d %d\n", serial, params->engine, params->sample_rate,
+            params->latency_ms, params->chunk_size);
+    if (fclose(out) || rename(tmp_path, path))
+    {
+        fprintf(stderr, "Can't write link profiles to %s\n", path);
+        return -1;
+    }
+
+    printf("Saved the link profile of %s (%s) to %s\n", serial, params->engine, path);
+    return 0;
 }
 
-int dump_memory(prog_params_t *params)
+/* Open one channel of the FT2232H with the link settings, exits on failure */
+struct ftdi_context *link_open_channel(nand_bus_t *bus, enum ftdi_interface interface,
+                                       int channel)
 {
-    FILE *fp;
-    unsigned int page_idx;
-    unsigned int page_idx_max;
-    unsigned char addr_cycles[5];
-    uint32_t mem_address;
-    unsigned char mem_large_block[PAGE_SIZE]; /* page content */
-    //    unsigned int byte_offset;
-    //    unsigned int line_no;
+    ftdi_link_t *link = bus->priv;
+    struct ftdi_context *ftdi;
+    int f;
 
-    fp = fopen(params->filename, "wb");
-    if (fp == NULL)
+    if ((ftdi = ftdi_new()) == NULL)
     {
-        fprintf(stderr, "Could not open file: %s\n", params->filename);
-        return -1;
+        fprintf(stderr, "ftdi_new failed for channel %d\n", channel);
+        exit(-1);
     }
-    printf("Opened output file: %s\n", params->filename);
 
-    int count = params->count;
-    if (count == 0)
+    ftdi_set_interface(ftdi, interface);
+    f = ftdi_usb_open(ftdi, FT2232H_VID, FT2232H_PID);
+    if (f < 0 && f != -5)
     {
-        count = DEFAULT_PAGE_COUNT - params->start_page;
+        fprintf(stderr, "unable to open ftdi device: %d (%s)  --  " \
+                        "Should you run as root?\n", f,
+          ftdi_get_error_string(ftdi));
+        ftdi_free(ftdi);
+        exit(-1);
     }
+    printf("ftdi open succeeded(channel %d): %d\n", channel, f);
 
-    // Start reading the data
-    page_idx_max = params->start_page + count;
-    for (page_idx = params->start_page; page_idx < page_idx_max; /* blocks per page * overall blocks */ page_idx++)
+    ftdi_set_latency_timer(ftdi, link->latency_ms);
+    if (link->chunk_size)
     {
-      mem_address = page_idx * PAGE_SIZE_NOSPARE; // start address
-      printf("Reading data from page %d / %d (%.2f %%), address: %08X\n", 
-             page_idx, page_idx_max, (float)page_idx/(float)page_idx_max * 100,
-             mem_address);
-      {
+        ftdi_write_data_set_chunksize(ftdi, link->chunk_size);
+        ftdi_read_data_set_chunksize(ftdi, link->chunk_size);
+    }
 
-          DBG("Latching first command byte to read a page: ");
-          latch_command(params, CMD_READ1[0]);
+    return ftdi;
+}
 
-          get_address_cycle_map_x8_toshiba_page(page_idx, 0, addr_cycles);
-          DBG("Latching address cycles: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
-              addr_cycles[0], addr_cycles[1], /* column address */
-              addr_cycles[2], addr_cycles[3], addr_cycles[4]); /* row address */
-          latch_address(params, addr_cycles, 5);
+int link_init(nand_bus_t *bus, prog_params_t *params)
+{
+    ftdi_link_t *link = calloc(1, sizeof(*link));
+    if (link == NULL)
+    {
+        fprintf(stderr, "malloc error, size=%zu\n", sizeof(*link));
+        return -1;
+    }
 
-          DBG("Latching second command byte to read a page: ");
-          latch_command(params, CMD_READ1[1]);
+    /* whatever isn't on the command line comes from the device's profile */
+    if (link_serial(link->serial, sizeof(link->serial)) == 0 && !params->calibrate)
+    {
+        profile_load(params, link->serial);
+    }
+    if (!params->sample_rate)
+        params->sample_rate = DEFAULT_SAMPLE_RATE;
+    if (!params->latency_ms)
+        params->latency_ms = DEFAULT_LATENCY_MS;
+    link->latency_ms = params->latency_ms;
+    link->chunk_size = params->chunk_size;
+
+    link->iobus_dir = IOBUS_BITMASK_WRITE;
+    link->update_ns = 1000000000UL / params->sample_rate;
+    if (link->update_ns == 0)
+    {
+        link->update_ns = 1;
+    }
+    link->async.depth = params->async_depth;
+    bus->priv = link;
+    return 0;
+}
 
-          // busy-wait for high level at the busy line
-          wait_while_busy();
+const char *link_get_serial(nand_bus_t *bus)
+{
+    ftdi_link_t *link = bus->priv;
+    return link->serial[0] ? link->serial : NULL;
+}
 
-          DBG("Clocking out data block...\n");
-          latch_register(params, mem_large_block, PAGE_SIZE);
-      }
+void close_bus(struct ftdi_context *bus, char *msg)
+{
+    printf("%s", msg);
+    ftdi_disable_bitbang(bus);
+    ftdi_usb_close(bus);
+    ftdi_free(bus);
+}
 
-//      // Dumping memory to console and file
-//      // 2112 bytes = 132 lines * 16 bytes/line
-//      for( line_no = 0; line_no < 132; line_no++ )
-//      {
-//          byte_offset = line_no * 16;
-//
-//          // Dumping memory to console
-//          // printf("%02X %02X %02X %02X %02X %02X %02X %02X  %02X %02X %02X %02X %02X %02X %02X %02X | ",
-//          //     mem_large_block[byte_offset+0], mem_large_block[byte_offset+1],
+void link_close(nand_bus_t *bus)
+{
+    ftdi_link_t *link = bus->priv;
+
+    close_bus(link->iobus, "disabling bitbang mode (channel 1)\n");
+    if (link->controlbus != link->iobus)
+    {
+        close_bus(link->controlbus, "disabling bitbang mode (channel 2)\n");
+    }
+    free(link);
+}
+
+/*
+ * bitbang backend: I/O bus on INTERFACE_A, control bus on INTERFACE_B, both
+ * in bit-bang mode (the original wiring). Pin updates go out at the sample
+ * rate (-r), 16 per baud clock.
+ */
+#define BITBANG_CLOCKS_PER_BAUD 16
+int bitbang_open(nand_bus_t *bus, prog_params_t *params)
+{
+    if (link_init(bus, params))
+    {
+        return -1;
+    }
+    ftdi_link_t *link = bus->priv;
+
+    // Init 1. channel for databus
+    link->iobus = link_open_channel(bus, INTERFACE_A, 1);
+
+    printf("enabling bitbang mode(channel 1)\n");
+    ftdi_set_bitmode(link->iobus, IOBUS_BITMASK_WRITE, BITMODE_BITBANG);
+    ftdi_set_baudrate(link->iobus, params->sample_rate / BITBANG_CLOCKS_PER_BAUD);
+
+    // Init 2. channel
+    link->controlbus = link_open_channel(bus, INTERFACE_B, 2);
+
+    printf("enabling bitbang mode (channel 2)\n");
+    ftdi_set_bitmode(link->controlbus, CONTROLBUS_BITMASK, BITMODE_BITBANG);
+    ftdi_set_baudrate(link->controlbus, params->sample_rate / BITBANG_CLOCKS_PER_BAUD);
+
+    return 0;
+}
+
+/* Repeat the current value; only ever on one channel, so it's exact */
+void bitbang_pad(nand_bus_t *bus, bus_chan_t chan, unsigned int ns)
+{
+    ftdi_link_t *link = bus->priv;
+    unsigned char value = chan == CHAN_IOBUS ? bus->iobus_value : bus->controlbus_value;
+
+    for (unsigned int k = bus_pad_count(ns, link->update_ns); k; k--)
+    {
+        link_append(bus, chan, value);
+    }
+}
+
+void bitbang_set_pins(nand_bus_t *bus, bus_chan_t chan, unsigned char value)
+{
+    link_append(bus, chan, value);
+
+    if (!bus->batching)
+    {
+        link_flush(bus);
+    }
+}
+
+unsigned char bitbang_read_pins(nand_bus_t *bus, bus_chan_t chan)
+{
+    ftdi_link_t *link = bus->priv;
+    unsigned char buf;
+
+    bus_sync(bus);
+    bus->stats.reads++;
+    //ftdi_read_data(nandflash_iobus, buf, 1); /* buffer for FTDI function needed to be an array */
+    ftdi_read_pins(chan == CHAN_IOBUS ? link->iobus : link->controlbus, &buf);
+    return buf;
+}
+
+void bitbang_set_direction(nand_bus_t *bus, iobus_inout_t inout)
+{
+    ftdi_link_t *link = bus->priv;
+
+    bus_sync(bus);
+    bus->stats.bitmodes++;
+    link->syncbb = 0;
+
+    if (inout == IOBUS_OUT)
+        ftdi_set_bitmode(link->iobus, IOBUS_BITMASK_WRITE, BITMODE_BITBANG);
+    else if (inout == IOBUS_IN)
+        ftdi_set_bitmode(link->iobus, IOBUS_BITMASK_READ, BITMODE_BITBANG);
+}
+
+/* Bulk reads through synchronous bit-bang (see above) */
+int bitbang_read_cycles(nand_bus_t *bus, unsigned char data[], unsigned int length,
+                        int deferred)
+{
+    ftdi_link_t *link = bus->priv;
+    int ret;
+
+    if (!bus->batching || length < SYNCBB_MIN_LENGTH)
+    {
+        return bus_read_by_pins(bus, data, length);
+    }
+
+    /* sync bit-bang with the I/O bus as input also does for pin reads, so
+     * the bus stays in it until the next write */
+    if (!link->syncbb)
+    {
+        bus_sync(bus);
+        bus->stats.bitmodes++;
+        ftdi_set_bitmode(link->iobus, IOBUS_BITMASK_READ, BITMODE_SYNCBB);
+        link->syncbb = 1;
+    }
+    bus->iobus_dir = IOBUS_IN;
+    bus->iobus_dir_valid = 1;
+
+    ret = link_read_cycles(bus, data, length, 0, 0x00, SYNCBB_SAMPLES_PER_BYTE,
+                           SYNCBB_CHUNK, 0);
+
+    /* the strobes went out on the I/O bus latch */
+    bus_invalidate(bus, CHAN_IOBUS);
+    iobus_set_direction(bus, IOBUS_OUT);
+    return ret;
+}
+
+const bus_ops_t bitbang_ops = {
+    .name = "bitbang",
+    .open = bitbang_open,
+    .close = link_close,
+    .serial = link_get_serial,
+    .set_pins = bitbang_set_pins,
+    .read_pins = bitbang_read_pins,
+    .set_direction = bitbang_set_direction,
+    .flush = ftdi_bus_flush,
+    .pad = bitbang_pad,
+    .read_cycles = bitbang_read_cycles,
+};
+
+/*
+ * mpsse backend: everything on INTERFACE_A in MPSSE mode, I/O bus as ADBUS
+ * GPIO (low byte), control bus as ACBUS GPIO (high byte), so control and
+ * data edges share one command stream.
+ */
+int mpsse_open(nand_bus_t *bus, prog_params_t *params)
+{
+    if (link_init(bus, params))
+    {
+        return -1;
+    }
+    ftdi_link_t *link = bus->priv;
+
+    link->iobus = link_open_channel(bus, INTERFACE_A, 1);
+
+    printf("enabling MPSSE mode(channel 1)\n");
+    ftdi_set_bitmode(link->iobus, 0x00, BITMODE_RESET);
+    ftdi_set_bitmode(link->iobus, 0x00, BITMODE_MPSSE);
+
+    link->controlbus = link->iobus;
+    return 0;
+}
+
+void mpsse_set_pins(nand_bus_t *bus, bus_chan_t chan, unsigned char value)
+{
+    ftdi_link_t *link = bus->priv;
+
+    /* ADBUS is the low GPIO byte, ACBUS the high one */
+    link_append(bus, CHAN_IOBUS, chan == CHAN_IOBUS ? SET_BITS_LOW : SET_BITS_HIGH);
+    link_append(bus, CHAN_IOBUS, value);
+    link_append(bus, CHAN_IOBUS, chan == CHAN_IOBUS ? link->iobus_dir : CONTROLBUS_BITMASK);
+
+    if (!bus->batching)
+    {
+        link_flush(bus);
+    }
+}
+
+/*
+ * The MPSSE has no plain delay command (clocking TCK would toggle IO0), so
+ * a hold repeats the SET_BITS command; each takes about MPSSE_UPDATE_NS to
+ * execute.
+ */
+#define MPSSE_UPDATE_NS 50
+
+void mpsse_pad(nand_bus_t *bus, bus_chan_t chan, unsigned int ns)
+{
+    unsigned char value = chan == CHAN_IOBUS ? bus->iobus_value : bus->controlbus_value;
+
+    for (unsigned int k = bus_pad_count(ns, MPSSE_UPDATE_NS); k; k--)
+    {
+        mpsse_set_pins(bus, chan, value);
+    }
+}
+
+/* Run a single GET_BITS_LOW / GET_BITS_HIGH */
+unsigned char mpsse_read_bits(nand_bus_t *bus, unsigned char command)
+{
+    unsigned char buf = 0;
+    link_append(bus, CHAN_IOBUS, command);
+    link_append(bus, CHAN_IOBUS, SEND_IMMEDIATE);
+    link_read_samples(bus, &buf, 1, 0);
+    return buf;
+}
+
+unsigned char mpsse_read_pins(nand_bus_t *bus, bus_chan_t chan)
+{
+    return mpsse_read_bits(bus, chan == CHAN_IOBUS ? GET_BITS_LOW : GET_BITS_HIGH);
+}
+
+void mpsse_set_direction(nand_bus_t *bus, iobus_inout_t inout)
+{
+    ftdi_link_t *link = bus->priv;
+
+    /* direction is part of SET_BITS_LOW, no control transfer needed */
+    link->iobus_dir = (inout == IOBUS_OUT) ? IOBUS_BITMASK_WRITE : IOBUS_BITMASK_READ;
+    mpsse_set_pins(bus, CHAN_IOBUS, bus->iobus_value);
+}
+
+int mpsse_read_cycles(nand_bus_t *bus, unsigned char data[], unsigned int length,
+                      int deferred)
+{
+    int ret;
+
+    if (!bus->batching)
+    {
+        return bus_read_by_pins(bus, data, length);
+    }
+
+    iobus_set_direction(bus, IOBUS_IN);
+    ret = link_read_cycles(bus, data, length, deferred, GET_BITS_LOW, 1, MPSSE_CHUNK, 1);
+    iobus_set_direction(bus, IOBUS_OUT);
+    return ret;
+}
+
+const bus_ops_t mpsse_ops = {
+    .name = "mpsse",
+    .open = mpsse_open,
+    .close = link_close,
+    .serial = link_get_serial,
+    .set_pins = mpsse_set_pins,
+    .read_pins = mpsse_read_pins,
+    .set_direction = mpsse_set_direction,
+    .flush = ftdi_bus_flush,
+    .pad = mpsse_pad,
+    .read_cycles = mpsse_read_cycles,
+};
+
+/*
+ * mcu backend: MCU host bus emulation, the FT2232H generates the nWE/nRE
+ * strobes itself and CLE/ALE/nCE/nWP ride on the high address byte. This
+ * also takes over the channel B pins (RD#, WR#, I/O1), so channel B is not
+ * opened.
+ */
+int mcu_open(nand_bus_t *bus, prog_params_t *params)
+{
+    unsigned char init[4];
+
+    if (link_init(bus, params))
+    {
+        return -1;
+    }
+    ftdi_link_t *link = bus->priv;
+
+    link->iobus = link_open_channel(bus, INTERFACE_A, 1);
+
+    printf("enabling MCU host bus emulation mode(channel 1)\n");
+    ftdi_set_bitmode(link->iobus, 0x00, BITMODE_RESET);
+    ftdi_set_bitmode(link->iobus, 0x00, BITMODE_MCU);
+    link->controlbus = link->iobus;
+
+    /* 60MHz bus clock, or 12MHz with mcu:slow for boards that can't keep up;
+     * I/O0 as output (low), I/O1 (RDY) as input */
+    init[0] = (params->engine_arg && !strcmp(params->engine_arg, "slow")) ? EN_DIV_5 : DIS_DIV_5;
+    init[1] = SET_BITS_HIGH;
+    init[2] = 0x00;
+    init[3] = 0x01;
+    link_write(bus, link->iobus, init, sizeof(init));
+
+    return 0;
+}
+
+unsigned char mcu_read_pins(nand_bus_t *bus, bus_chan_t chan)
+{
+    ftdi_link_t *link = bus->priv;
+    unsigned char buf;
+
+    if (chan == CHAN_CONTROLBUS)
+    {
+        /* only RDY can be read back, on I/O1 */
+        buf = mpsse_read_bits(bus, GET_BITS_HIGH);
+        return (buf & MCU_IO1_RDY) ? PIN_RDY : 0;
+    }
+
+    bus_sync(bus);
+    bus->stats.reads++;
+    ftdi_read_pins(link->iobus, &buf);
+    return buf;
+}
+
+/* High address byte for a host bus cycle, from the current control bus state */
+unsigned char mcu_addr_high(nand_bus_t *bus, unsigned char latch)
+{
+    unsigned char addr = 0;
+    if (latch & PIN_CLE)
+        addr |= MCU_ADDR_CLE;
+    if (latch & PIN_ALE)
+        addr |= MCU_ADDR_ALE;
+    if (bus->controlbus_value & PIN_nCE)
+        addr |= MCU_ADDR_nCE;
+    if (bus->controlbus_value & PIN_nCE2)
+        addr |= MCU_ADDR_nCE2;
+    if (bus->controlbus_value & PIN_nWP)
+        addr |= MCU_ADDR_nWP;
+    return addr;
+}
+
+/*
+ * Host bus write cycles: the FT2232H strobes WR# (nWE) for every byte.
+ * Only the first cycle needs the high address byte, the following ones keep
+ * it and only send the (unused) low address byte.
+ */
+int mcu_write_cycles(nand_bus_t *bus, unsigned char latch, unsigned char data[],
+                     unsigned int length)
+{
+    for (unsigned int k = 0; k < length; k++)
+    {
+        if (k == 0)
+        {
+            link_append(bus, CHAN_IOBUS, WRITE_EXTENDED);
+            link_append(bus, CHAN_IOBUS, mcu_addr_high(bus, latch));
+        }
+        else
+        {
+            link_append(bus, CHAN_IOBUS, WRITE_SHORT);
+        }
+        link_append(bus, CHAN_IOBUS, 0x00);
+        link_append(bus, CHAN_IOBUS, data[k]);
+    }
+
+    if (!bus->batching)
+    {
+        link_flush(bus);
+    }
+    return 0;
+}
+
+/* Host bus read cycles: the FT2232H strobes RD# (nRE) and samples AD7..0 */
+int mcu_read_cycles(nand_bus_t *bus, unsigned char data[], unsigned int length,
+                    int deferred)
+{
+    unsigned int done = 0;
+    while (done < length)
+    {
+        unsigned int chunk = length - done;
+        if (chunk > MPSSE_CHUNK)
+        {
+            chunk = MPSSE_CHUNK;
+        }
+
+        for (unsigned int k = 0; k < chunk; k++)
+        {
+            if (k == 0)
+            {
+                link_append(bus, CHAN_IOBUS, READ_EXTENDED);
+                link_append(bus, CHAN_IOBUS, mcu_addr_high(bus, 0));
+            }
+            else
+            {
+                link_append(bus, CHAN_IOBUS, READ_SHORT);
+            }
+            link_append(bus, CHAN_IOBUS, 0x00);
+        }
+        link_append(bus, CHAN_IOBUS, SEND_IMMEDIATE);
+
+        if (link_read_samples(bus, data + done, chunk, deferred))
+        {
+            return EXIT_FAILURE;
+        }
+        done += chunk;
+    }
+
+    return 0;
+}
+
+const bus_ops_t mcu_ops = {
+    .name = "mcu",
+    .open = mcu_open,
+    .close = link_close,
+    .serial = link_get_serial,
+    .read_pins = mcu_read_pins,
+    .flush = ftdi_bus_flush,
+    .write_cycles = mcu_write_cycles,
+    .read_cycles = mcu_read_cycles,
+};
+
+/*
+ * sim backend: no hardware, a simulated NAND (nand-sim.c) at the command
+ * level, backed by the file given with -e sim:file. Bus cycles are charged
+ * to the chip's virtual clock as the single channel engines would spend
+ * them: one USB round trip per transfer (a flush, a read back, a RDY poll)
+ * plus a fixed time per bus cycle, so the simulated time at the end
+ * predicts a real rig and busy times overlap transfers as they would there.
+ */
+#define SIM_DEFAULT_FILE    "nand-sim.bin"
+#define SIM_USB_LATENCY_NS  125000ULL /* one USB round trip, a high speed microframe */
+#define SIM_CYCLE_NS        100ULL    /* one host bus cycle, command bytes included */
+
+typedef struct _sim_link {
+    nand_sim_t *chips[DIE_MAX]; /* a chip per die, on the virtual clock of the first */
+    int dies;
+    int pending;     /* cycles queued since the last flush */
+} sim_link_t;
+
+/* The clock runs for all the chips */
+void sim_advance(sim_link_t *link, uint64_t ns)
+{
+    for (int d = 0; d < link->dies; d++)
+    {
+        nand_sim_advance(link->chips[d], ns);
+    }
+}
+
+/* Chip whose nCE is low, NULL if none */
+nand_sim_t *sim_selected(nand_bus_t *bus)
+{
+    sim_link_t *link = bus->priv;
+
+    for (int d = 0; d < link->dies; d++)
+    {
+        if (~bus->controlbus_value & die_nce_pins[d])
+        {
+            return link->chips[d];
+        }
+    }
+    return NULL;
+}
+
+/* Account for a USB transfer starting now */
+void sim_transfer(nand_bus_t *bus)
+{
+    sim_advance(bus->priv, SIM_USB_LATENCY_NS);
+}
+
+void sim_close(nand_bus_t *bus);
+
+/* The first die's chip is in the file, the others in file.1 and up */
+int sim_open(nand_bus_t *bus, prog_params_t *params)
+{
+    const char *path = params->engine_arg ? params->engine_arg : SIM_DEFAULT_FILE;
+    sim_link_t *link = calloc(1, sizeof(*link));
+    char die_path[PATH_MAX];
+
+    if (link == NULL)
+    {
+        fprintf(stderr, "malloc error, size=%zu\n", sizeof(*link));
+        return -1;
+    }
+    bus->priv = link;
+
+    for (int d = 0; d < params->dies; d++)
+    {
+        if (d == 0)
+            snprintf(die_path, sizeof(die_path), "%s", path);
+        else
+            snprintf(die_path, sizeof(die_path), "%s.%d", path, d);
+
+        if ((link->chips[d] = nand_sim_open(die_path, geometry.page_size, geometry.pages_per_block,
+                                            geometry.block_count)) == NULL)
+        {
+            sim_close(bus);
+            return -1;
+        }
+        link->dies++;
+        printf("simulated NAND in %s\n", die_path);
+    }
+
+    return 0;
+}
+
+void sim_close(nand_bus_t *bus)
+{
+    sim_link_t *link = bus->priv;
+    unsigned long reads = 0, programs = 0, erases = 0, copy_backs = 0, bytes = 0;
+    double secs = link->dies ? link->chips[0]->now_ns / 1e9 : 0.0;
+
+    for (int d = 0; d < link->dies; d++)
+    {
+        nand_sim_t *chip = link->chips[d];
+        reads += chip->reads;
+        programs += chip->programs;
+        erases += chip->erases;
+        copy_backs += chip->copy_backs;
+        /* copy-back moves its pages inside the chip, they count too */
+        bytes += chip->bytes_out + chip->bytes_in + chip->copy_backs * chip->page_size;
+        nand_sim_close(chip);
+    }
+
+    if (link->dies)
+    {
+        printf("simulated time: %.3f s, %lu page reads, %lu programs (%lu copy-back), "
+               "%lu erases, %.1f KiB/s of page data\n", secs, reads, programs, copy_backs,
+               erases, secs > 0 ? bytes / 1024.0 / secs : 0.0);
+    }
+    free(link);
+}
+
+/* RDY is shared: low while any chip is busy */
+unsigned char sim_read_pins(nand_bus_t *bus, bus_chan_t chan)
+{
+    sim_link_t *link = bus->priv;
+
+    bus_sync(bus);
+    bus->stats.reads++;
+    sim_transfer(bus);
+
+    if (chan == CHAN_CONTROLBUS)
+    {
+        for (int d = 0; d < link->dies; d++)
+        {
+            if (!nand_sim_ready(link->chips[d]))
+            {
+                return 0;
+            }
+        }
+        return PIN_RDY;
+    }
+    return 0x00;
+}
+
+int sim_flush(nand_bus_t *bus, int wait)
+{
+    sim_link_t *link = bus->priv;
+
+    if (link->pending)
+    {
+        bus->stats.writes++;
+        bus->stats.bytes += link->pending;
+        link->pending = 0;
+    }
+    return 0;
+}
+
+/* Sleeps pass on the virtual clock */
+void sim_sleep(nand_bus_t *bus, unsigned int us)
+{
+    sim_advance(bus->priv, us * 1000ULL);
+}
+
+unsigned long long sim_now(nand_bus_t *bus)
+{
+    sim_link_t *link = bus->priv;
+    return link->chips[0]->now_ns / 1000;
+}
+
+int sim_write_cycles(nand_bus_t *bus, unsigned char latch, unsigned char data[],
+                     unsigned int length)
+{
+    sim_link_t *link = bus->priv;
+    nand_sim_t *chip = sim_selected(bus);
+
+    for (int d = 0; d < link->dies; d++)
+    {
+        nand_sim_set_wp(link->chips[d], !(bus->controlbus_value & PIN_nWP));
+    }
+    if (!link->pending)
+    {
+        sim_transfer(bus);
+    }
+    link->pending += length;
+
+    for (unsigned int k = 0; k < length; k++)
+    {
+        sim_advance(link, SIM_CYCLE_NS);
+        if (chip == NULL)
+            continue;
+        if (latch & PIN_CLE)
+            nand_sim_command(chip, data[k]);
+        else if (latch & PIN_ALE)
+            nand_sim_address(chip, data[k]);
+        else
+            nand_sim_write(chip, data[k]);
+    }
+
+    if (!bus->batching)
+    {
+        bus_flush(bus);
+    }
+    return 0;
+}
+
+int sim_read_cycles(nand_bus_t *bus, unsigned char data[], unsigned int length,
+                    int deferred)
+{
+    sim_link_t *link = bus->priv;
+    nand_sim_t *chip = sim_selected(bus);
+
+    bus_sync(bus);
+    bus->stats.bulk_reads++;
+    sim_transfer(bus);
+
+    for (unsigned int k = 0; k < length; k++)
+    {
+        sim_advance(link, SIM_CYCLE_NS);
+        data[k] = chip ? nand_sim_read(chip) : 0xFF;
+    }
+    return 0;
+}
+
+const bus_ops_t sim_ops = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .read_pins = sim_read_pins,
+    .flush = sim_flush,
+    .sleep = sim_sleep,
+    .now = sim_now,
+    .write_cycles = sim_write_cycles,
+    .read_cycles = sim_read_cycles,
+};
+
+const bus_ops_t *bus_backends[] = { &bitbang_ops, &mpsse_ops, &mcu_ops, &sim_ops, NULL };
+
+nand_bus_t *bus_open(prog_params_t *params)
+{
+    const bus_ops_t *ops = NULL;
+    nand_bus_t *bus;
+
+    for (int i = 0; bus_backends[i]; i++)
+    {
+        if (!strcmp(bus_backends[i]->name, params->engine))
+        {
+            ops = bus_backends[i];
+        }
+    }
+    if (ops == NULL)
+    {
+        fprintf(stderr, "Unknown bus engine: %s\n", params->engine);
+        return NULL;
+    }
+
+    if ((bus = calloc(1, sizeof(*bus))) == NULL)
+    {
+        fprintf(stderr, "malloc error, size=%zu\n", sizeof(*bus));
+        return NULL;
+    }
+    bus->ops = ops;
+    bus->delay = params->delay;
+    bus->batching = !params->unbatched;
+    bus->dies = params->dies;
+
+    if (ops->open(bus, params))
+    {
+        free(bus);
+        return NULL;
+    }
+
+    return bus;
+}
+
+void bus_close(nand_bus_t *bus)
+{
+    bus_sync(bus);
+    bus->ops->close(bus);
+    free(bus);
+}
+
+void test_controlbus(nand_bus_t *bus)
+{
+    #define CONTROLBUS_TEST_DELAY 1000000 /* 1 sec */
+
+    printf("  CLE on\n");
+    controlbus_pin_set(bus, PIN_CLE, ON);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  ALE on\n");
+    controlbus_pin_set(bus, PIN_ALE, ON);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  nCE on\n");
+    controlbus_pin_set(bus, PIN_nCE, ON);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  nWE on\n");
+    controlbus_pin_set(bus, PIN_nWE, ON);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+
+    printf("  nRE on\n");
+    controlbus_pin_set(bus, PIN_nRE, ON);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  nWP on\n");
+    controlbus_pin_set(bus, PIN_nWP, ON);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  LED on\n");
+    controlbus_pin_set(bus, PIN_LED, ON);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+
+    printf("  CLE off\n");
+    controlbus_pin_set(bus, PIN_CLE, OFF);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  ALE off\n");
+    controlbus_pin_set(bus, PIN_ALE, OFF);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  nCE off\n");
+    controlbus_pin_set(bus, PIN_nCE, OFF);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  nWE off\n");
+    controlbus_pin_set(bus, PIN_nWE, OFF);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  nRE off\n");
+    controlbus_pin_set(bus, PIN_nRE, OFF);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  nWP off\n");
+    controlbus_pin_set(bus, PIN_nWP, OFF);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+
+    printf("  LED off\n");
+    controlbus_pin_set(bus, PIN_LED, OFF);
+    controlbus_update_output(bus);
+    bus_usleep(bus, CONTROLBUS_TEST_DELAY);
+}
+
+void test_iobus(nand_bus_t *bus)
+{
+    #define IOBUS_TEST_DELAY 1000000 /* 1 sec */
+
+    printf("  DIO0 on\n");
+    iobus_pin_set(bus, PIN_DIO0, ON);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    printf("  DIO1 on\n");
+    iobus_pin_set(bus, PIN_DIO1, ON);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    printf("  DIO2 on\n");
+    iobus_pin_set(bus, PIN_DIO2, ON);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    printf("  DIO3 on\n");
+    iobus_pin_set(bus, PIN_DIO3, ON);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    printf("  DIO4 on\n");
+    iobus_pin_set(bus, PIN_DIO4, ON);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    printf("  DIO5 on\n");
+    iobus_pin_set(bus, PIN_DIO5, ON);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    printf("  DIO6 on\n");
+    iobus_pin_set(bus, PIN_DIO6, ON);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    printf("  DIO7 on\n");
+    iobus_pin_set(bus, PIN_DIO7, ON);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+
+    iobus_pin_set(bus, PIN_DIO0, OFF);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    iobus_pin_set(bus, PIN_DIO1, OFF);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    iobus_pin_set(bus, PIN_DIO2, OFF);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    iobus_pin_set(bus, PIN_DIO3, OFF);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    iobus_pin_set(bus, PIN_DIO4, OFF);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    iobus_pin_set(bus, PIN_DIO5, OFF);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    iobus_pin_set(bus, PIN_DIO6, OFF);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    iobus_pin_set(bus, PIN_DIO7, OFF);
+    iobus_update_output(bus);
+    bus_usleep(bus, IOBUS_TEST_DELAY);
+
+    bus_usleep(bus, 5 * IOBUS_TEST_DELAY);
+    iobus_set_value(bus, 0xFF);
+    iobus_update_output(bus);
+    bus_usleep(bus, 5 * IOBUS_TEST_DELAY);
+    iobus_set_value(bus, 0xAA);
+    iobus_update_output(bus);
+    bus_usleep(bus, 5 * IOBUS_TEST_DELAY);
+    iobus_set_value(bus, 0x55);
+    iobus_update_output(bus);
+    bus_usleep(bus, 5 * IOBUS_TEST_DELAY);
+    iobus_set_value(bus, 0x00);
+    iobus_update_output(bus);
+
+
+    iobus_pin_set(bus, PIN_DIO0, ON);
+    iobus_pin_set(bus, PIN_DIO2, ON);
+    iobus_pin_set(bus, PIN_DIO4, ON);
+    iobus_pin_set(bus, PIN_DIO6, ON);
+    iobus_update_output(bus);
+    bus_usleep(bus, 2* 100000);
+
+}
+
+/* 
+ * "Command Input bus operation is used to give a command to the memory device.
+ *  Command are accepted with Chip Enable low, Command Latch Enable High, 
+ *  Address Latch Enable low and Read Enable High and latched on the rising
+ *  edge of Write Enable. Moreover for commands that starts a modify operation
+ *  (write/erase) the Write Protect pin must be high."
+*/
+int latch_command(prog_params_t *params, unsigned char command)
+{
+    nand_bus_t *bus = params->bus;
+
+    /* check if ALE is low and nRE is high */
+    if (!die_selected(bus))
+    {
+        fprintf(stderr, "latch_command requires nCE pin to be low\n");
+        return EXIT_FAILURE;
+    }
+    else if (~bus->controlbus_value & PIN_nRE)
+    {
+        fprintf(stderr, "latch_command requires nRE pin to be high\n");
+        return EXIT_FAILURE;
+    }
+
+    DBG("latch_command(0x%02X)\n", command);
+
+    if (bus->ops->write_cycles)
+    {
+        return bus->ops->write_cycles(bus, PIN_CLE, &command, 1);
+    }
+
+    /* change I/O pins first: nothing is latched while nWE stays high, and
+     * this lets the whole CLE/nWE sequence go out as a single control bus
+     * transfer */
+    DBGFLUSH("  I/O bus to command,");
+    iobus_set_value(bus, command);
+    iobus_update_output(bus);
+
+    /* toggle CLE high (activates the latching of the IO inputs inside the 
+     * Command Register on the Rising edge of nWE) */
+    DBGFLUSH(" setting CLE high,");
+    controlbus_pin_set(bus, PIN_CLE, ON);
+    controlbus_update_output(bus);
+    bus_hold(bus, CHAN_CONTROLBUS, T_CLS);
+
+    // toggle nWE low
+    DBGFLUSH(" nWE low,");
+    controlbus_pin_set(bus, PIN_nWE, OFF);
+    controlbus_update_output(bus);
+    bus_hold(bus, CHAN_CONTROLBUS, T_WP);
+
+    // toggle nWE back high (acts as clock to latch the command!)
+    DBGFLUSH(" nWE high,");
+    controlbus_pin_set(bus, PIN_nWE, ON);
+    controlbus_update_output(bus);
+    bus_hold(bus, CHAN_CONTROLBUS, T_WH);
+
+    // toggle CLE low
+    DBG(" CLE low\n");
+    controlbus_pin_set(bus, PIN_CLE, OFF);
+    controlbus_update_output(bus);
+
+    return 0;
+}
+
+/** 
+ * "Address Input bus operation allows the insertion of the memory address. 
+ * Five cycles are required to input the addresses for the 4Gbit devices. 
+ * Addresses are accepted with Chip Enable low, Address Latch Enable High, 
+ * Command Latch Enable low and Read Enable High and latched on the rising 
+ * edge of Write Enable. 
+ * 
+ * Moreover for commands that starts a modifying operation (write/erase) 
+ * the Write Protect pin must be high. See Figure 5 and Table 13 for details 
+ * of the timings requirements. 
+ * 
+ * Addresses are always applied on IO7:0 regardless of the bus configuration 
+ * (x8 or x16)."
+ */
+int latch_address(prog_params_t *params, unsigned char address[], unsigned int addr_length)
+{
+    nand_bus_t *bus = params->bus;
+    unsigned int addr_idx = 0;
+
+    /* check if ALE is low and nRE is high */
+    if (!die_selected(bus))
+    {
+        fprintf(stderr, "latch_address requires nCE pin to be low\n");
+        return EXIT_FAILURE;
+    }
+    else if (bus->controlbus_value & PIN_CLE)
+    {
+        fprintf(stderr, "latch_address requires CLE pin to be low\n");
+        return EXIT_FAILURE;
+    }
+    else if (~bus->controlbus_value & PIN_nRE)
+    {
+        fprintf(stderr, "latch_address requires nRE pin to be high\n");
+        return EXIT_FAILURE;
+    }
+
+    if (bus->ops->write_cycles)
+    {
+        return bus->ops->write_cycles(bus, PIN_ALE, address, addr_length);
+    }
+
+    /* toggle ALE high (activates the latching of the IO inputs inside
+     * the Address Register on the Rising edge of nWE. */
+    controlbus_pin_set(bus, PIN_ALE, ON);
+    controlbus_update_output(bus);
+    bus_hold(bus, CHAN_CONTROLBUS, T_ALS);
+
+    for (addr_idx = 0; addr_idx < addr_length; addr_idx++)
+    {
+        // toggle nWE low
+        controlbus_pin_set(bus, PIN_nWE, OFF);
+        controlbus_update_output(bus);
+        bus_hold(bus, CHAN_CONTROLBUS, T_WP);
+
+        // change I/O pins
+        iobus_set_value(bus, address[addr_idx]);
+        iobus_update_output(bus);
+        bus_hold(bus, CHAN_IOBUS, T_DS);
+
+        // toggle nWE back high (acts as clock to latch the current address byte!)
+        controlbus_pin_set(bus, PIN_nWE, ON);
+        controlbus_update_output(bus);
+        bus_hold(bus, CHAN_CONTROLBUS, T_WH);
+    }
+
+    // toggle ALE low
+    controlbus_pin_set(bus, PIN_ALE, OFF);
+    controlbus_update_output(bus);
+
+    // wait for ALE to nRE Delay tAR before nRE is taken low (nanoseconds!)
+
+    return 0;
+}
+
+/* Data Output bus operation allows to read data from the memory array and to 
+ * check the status register content, the EDC register content and the ID data.
+ * Data can be serially shifted out by toggling the Read Enable pin with Chip 
+ * Enable low, Write Enable High, Address Latch Enable low, and Command Latch 
+ * Enable low. */
+int latch_register_read(prog_params_t *params, unsigned char reg[], unsigned int reg_length,
+                        int deferred)
+{
+    nand_bus_t *bus = params->bus;
+
+    /* check if ALE is low and nRE is high */
+    if (!die_selected(bus))
+    {
+        fprintf(stderr, "latch_address requires nCE pin to be low\n");
+        return EXIT_FAILURE;
+    }
+    else if (~bus->controlbus_value & PIN_nWE)
+    {
+        fprintf(stderr, "latch_address requires nWE pin to be high\n");
+        return EXIT_FAILURE;
+    }
+    else if (bus->controlbus_value & PIN_ALE)
+    {
+        fprintf(stderr, "latch_address requires ALE pin to be low\n");
+        return EXIT_FAILURE;
+    }
+
+    if (bus->ops->read_cycles)
+    {
+        return bus->ops->read_cycles(bus, reg, reg_length, deferred);
+    }
+
+    return bus_read_by_pins(bus, reg, reg_length);
+}
+
+int latch_register(prog_params_t *params, unsigned char reg[], unsigned int reg_length)
+{
+    return latch_register_read(params, reg, reg_length, 0);
+}
+
+/*
+ * Same as latch_register(), but with async I/O the data may still be in
+ * flight on return: reg is only valid after the next bus_sync().
+ */
+int latch_register_deferred(prog_params_t *params, unsigned char reg[], unsigned int reg_length)
+{
+    return latch_register_read(params, reg, reg_length, 1);
+}
+
+/*
+ * Chip database, for chips that aren't ONFI: optional commands and sizes by
+ * chip (first two ID bytes). The entries of the chip database file (-g, or
+ * ~/CHIP_DB_FILE) come first, then the built-in ones below. Chips that
+ * aren't listed anywhere keep the default geometry and only get the basic
+ * read / program / erase sequences.
+ *
+ * A file entry is a line of
+ *   <ID byte 0> <ID byte 1> <name> <MiB per die> <planes> [options...]
+ * in hex, then decimal; options are the optional commands (cache-read,
+ * cache-program, multi-plane, status-enhanced, copy-back, unique-id) and, to override
+ * what the extended ID says, page=<main>+<spare> and ppb=<pages per block>.
+ * '#' starts a comment.
+ */
+#define CHIP_CACHE_READ    0x01 /* 31h/3Fh */
+#define CHIP_CACHE_PROGRAM 0x02 /* 15h */
+#define CHIP_MULTI_PLANE   0x04 /* 32h, 11h, D1h and 06h/E0h, ONFI style */
+#define CHIP_STATUS_ENHANCED 0x08 /* 78h */
+#define CHIP_COPY_BACK     0x10 /* 00h/35h, 85h/10h */
+#define CHIP_UNIQUE_ID     0x20 /* EDh */
+
+typedef struct _chip_db_entry {
+    unsigned char id[2];
+    char name[48];
+    unsigned int size_mib;      /* per die */
+    unsigned int planes;
+    unsigned int features;
+    unsigned int page_size_nospare; /* 0: from the extended ID */
+    unsigned int spare_size;
+    unsigned int pages_per_block;   /* 0: from the extended ID */
+} chip_db_entry_t;
+
+static const chip_db_entry_t chip_db_builtin[] = {
+    /* the chip the tool was written for */
+    { { 0xAD, 0xDC }, "AD DC (reference chip)", 256, 2, CHIP_COPY_BACK },
+    { { 0x98, 0xDA }, "Toshiba TC58NVG1S3H", 256, 2,
+      CHIP_CACHE_READ | CHIP_CACHE_PROGRAM | CHIP_COPY_BACK },
+};
+
+static const struct {
+    const char *name;
+    unsigned int feature;
+} chip_db_options[] = {
+    { "cache-read", CHIP_CACHE_READ },
+    { "cache-program", CHIP_CACHE_PROGRAM },
+    { "multi-plane", CHIP_MULTI_PLANE },
+    { "status-enhanced", CHIP_STATUS_ENHANCED },
+    { "copy-back", CHIP_COPY_BACK },
+    { "unique-id", CHIP_UNIQUE_ID },
+};
+
+/* Parse a chip database file line; 1 if it has an entry, 0 if blank, -1 if bad */
+int chip_db_parse(char *line, chip_db_entry_t *entry)
+{
+    char *comment = strchr(line, '#');
+    int used = 0;
+
+    if (comment)
+    {
+        *comment = '\0';
+    }
+    memset(entry, 0, sizeof(*entry));
+    if (sscanf(line, " %hhx %hhx %47s %u %u %n", &entry->id[0], &entry->id[1], entry->name,
+               &entry->size_mib, &entry->planes, &used) < 5 || used == 0)
+    {
+        return strspn(line, " \t\r\n") == strlen(line) ? 0 : -1;
+    }
+
+    for (char *opt = strtok(line + used, " \t\r\n"); opt; opt = strtok(NULL, " \t\r\n"))
+    {
+        unsigned int i;
+
+        if (sscanf(opt, "page=%u+%u", &entry->page_size_nospare, &entry->spare_size) == 2
+            || sscanf(opt, "ppb=%u", &entry->pages_per_block) == 1)
+        {
+            continue;
+        }
+        for (i = 0; i < sizeof(chip_db_options) / sizeof(chip_db_options[0]); i++)
+        {
+            if (!strcmp(opt, chip_db_options[i].name))
+            {
+                entry->features |= chip_db_options[i].feature;
+                break;
+            }
+        }
+        if (i == sizeof(chip_db_options) / sizeof(chip_db_options[0]))
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/* Find the chip in the database file, then the built-in entries; 0 if found */
+int chip_db_lookup(prog_params_t *params, unsigned char *ID_register, chip_db_entry_t *entry)
+{
+    char path[PATH_MAX];
+    char line[256];
+    int line_no = 0;
+    FILE *f;
+
+    if (params->chip_db)
+    {
+        snprintf(path, sizeof(path), "%s", params->chip_db);
+    }
+    else
+    {
+        const char *home = getenv("HOME");
+        snprintf(path, sizeof(path), "%s/%s", home ? home : ".", CHIP_DB_FILE);
+    }
+
+    if ((f = fopen(path, "r")) != NULL)
+    {
+        while (fgets(line, sizeof(line), f))
+        {
+            int ret = chip_db_parse(line, entry);
+
+            line_no++;
+            if (ret < 0)
+            {
+                fprintf(stderr, "%s:%d: bad chip entry, ignored\n", path, line_no);
+            }
+            else if (ret > 0 && !memcmp(entry->id, ID_register, sizeof(entry->id)))
+            {
+                printf("Chip found in %s\n", path);
+                fclose(f);
+                return 0;
+            }
+        }
+        fclose(f);
+    }
+    else if (params->chip_db)
+    {
+        fprintf(stderr, "Could not open chip database: %s\n", path);
+    }
+
+    for (unsigned int i = 0; i < sizeof(chip_db_builtin) / sizeof(chip_db_builtin[0]); i++)
+    {
+        if (!memcmp(chip_db_builtin[i].id, ID_register, sizeof(chip_db_builtin[i].id)))
+        {
+            *entry = chip_db_builtin[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Geometry of a chip database entry. Page, spare and block sizes that the
+ * entry doesn't give are decoded from the 4th ID byte, the usual way for
+ * large page chips: page size 1 KiB << bits 0-1, spare area 8 << bit 2
+ * bytes per 512, block size 64 KiB << bits 4-5.
+ */
+void chip_db_geometry(chip_db_entry_t *entry, unsigned char *ID_register,
+                      chip_geometry_t *geo)
+{
+    unsigned char ext = ID_register[3];
+    unsigned int main_size = entry->page_size_nospare;
+    unsigned int spare_size = entry->spare_size;
+    unsigned int pages_per_block = entry->pages_per_block;
+
+    if (main_size == 0)
+    {
+        main_size = 1024 << (ext & 0x03);
+        spare_size = (main_size / 512) * (8 << ((ext >> 2) & 0x01));
+    }
+    if (pages_per_block == 0)
+    {
+        pages_per_block = (65536 << ((ext >> 4) & 0x03)) / main_size;
+    }
+
+    snprintf(geo->name, sizeof(geo->name), "%s", entry->name);
+    geo->page_size_nospare = main_size;
+    geo->page_size = main_size + spare_size;
+    geo->pages_per_block = pages_per_block;
+    geo->block_count = (unsigned int)(((unsigned long long)entry->size_mib << 20)
+                                      / ((unsigned long long)main_size * pages_per_block));
+    geo->planes = entry->planes;
+    geo->column_cycles = 2;
+    geo->row_cycles = geo->block_count * pages_per_block > 65536 ? 3 : 2;
+}
+
+/* 
+ * Address Cycle Map calculations, for Toshiba TC58NVG1S3HTA00, page based.
+ *
+ * CA: Column Address (12 bits)
+ * PA: Page Address 17 bits (6 bits page in block, 11 bits block address)
+ *
+ * NOTE: this will actually populate the 2nd byte (CA high) with all 8
+ * bits (instead of 4), and the 5th byte (PA16..) with all 8 bits instead
+ * of just 1 to let the function be more generalizable then the 2048*131072
+ * configuration of the toshiba chip. If not acceptable, this function
+ * should somehow fail instead of silently producing the wrong address
+ * bytes.
+ *
+ * The number of column and row cycles comes from the chip geometry:
+ * chips of up to 65536 pages per die take a single row cycle less.
+ *
+ * With several dies (-D), page is counted across all of them; the die is
+ * picked by its nCE (die_select()), so only the page within it is sent.
+ */
+void get_address_cycle_map_x8_toshiba_page(unsigned int page, 
+                                           unsigned int column, 
+                                           unsigned char* addr_cycles)
+{
+    page %= geometry.page_count;
+    for (unsigned int i = 0; i < geometry.column_cycles; i++)
+    {
+        *addr_cycles++ = (unsigned char) ((column >> (8 * i)) & 0xFF); // CA0..CA7, CA8..CA11 //NOTE
+    }
+    for (unsigned int i = 0; i < geometry.row_cycles; i++)
+    {
+        *addr_cycles++ = (unsigned char) ((page >> (8 * i)) & 0xFF); // PA0..PA7, PA8..PA15, PA16 // SEE NOTE
+    }
+}
+
+/* Address Cycle Map calculations 
+ *
+ * NOTE(vm): this was the original address calculation. I swapped it
+ * with the "_toshiba" one that's appropriate for the Toshiba TC58NVG1S3HTA00
+ * chip I'm working with.
+ */
+void get_address_cycle_map_x8(uint32_t mem_address, unsigned char* addr_cylces)
+{
+    addr_cylces[0] = (unsigned char)(  mem_address & 0x000000FF);
+    addr_cylces[1] = (unsigned char)( (mem_address & 0x00000F00) >> 8 );
+    addr_cylces[2] = (unsigned char)( (mem_address & 0x000FF000) >> 12 );
+    addr_cylces[3] = (unsigned char)( (mem_address & 0x0FF00000) >> 20 );
+    addr_cylces[4] = (unsigned char)( (mem_address & 0x30000000) >> 28 );
+}
+
+/*
+ * Ready/busy wait engine.
+ *
+ * Each operation type has an expected busy time, seeded with the data sheet
+ * typical value and then following what the chip actually does (a moving
+ * average of the observed waits). A wait sleeps through most of the expected
+ * time when that is long enough to be worth a sleep, then polls with a
+ * doubling interval, and gives up after the operation's timeout. Polling is
+ * on the RDY pin, or on the status register (70h, bit 6) with -W status for
+ * rigs where RDY isn't wired or can't be read.
+ */
+typedef enum {
+    WAIT_READ=0, WAIT_CACHE=1, WAIT_PROGRAM=2, WAIT_CACHE_PROGRAM=3, WAIT_ERASE=4,
+    WAIT_PLANE=5, WAIT_OPS=6
+} wait_op_t;
+
+#define WAIT_SLEEP_MIN_US 250   /* shorter waits just poll, a poll costs a USB round trip anyway */
+#define WAIT_SLEEP_PERCENT 75   /* of the expected time, slept before the first poll */
+#define WAIT_POLL_MIN_US 20
+#define WAIT_POLL_MAX_US 1000
+#define WAIT_AVERAGE_SHIFT 3    /* expected time moves by 1/8 of the difference per wait */
+
+typedef struct _wait_stats {
+    const char *name;
+    unsigned long expected_us;
+    unsigned long timeout_us;
+    unsigned long waits;
+    unsigned long polls;
+    unsigned long long total_us;
+    unsigned long min_us;
+    unsigned long max_us;
+} wait_stats_t;
+
+struct _wait_engine {
+    int use_status;             /* poll the status register instead of RDY */
+    wait_stats_t ops[WAIT_OPS];
+};
+
+void wait_engine_init(wait_engine_t *wait, prog_params_t *params)
+{
+    /* typical tR / tDCBSYR / tPROG / tBERS / tDBSY, timeouts well above the data sheet
+     * maximums; a cache program waits for what is left of the previous program */
+    const wait_stats_t defaults[WAIT_OPS] = {
+        [WAIT_READ]    = { .name = "read",    .expected_us = 25,   .timeout_us = 50000 },
+        [WAIT_CACHE]   = { .name = "cache read", .expected_us = 5, .timeout_us = 50000 },
+        [WAIT_PROGRAM] = { .name = "program", .expected_us = 300,  .timeout_us = 50000 },
+        [WAIT_CACHE_PROGRAM] = { .name = "cache program", .expected_us = 100, .timeout_us = 50000 },
+        [WAIT_ERASE]   = { .name = "erase",   .expected_us = 2500, .timeout_us = 500000 },
+        [WAIT_PLANE]   = { .name = "multi-plane queue", .expected_us = 1, .timeout_us = 50000 },
+    };
+
+    memset(wait, 0, sizeof(*wait));
+    memcpy(wait->ops, defaults, sizeof(defaults));
+    wait->use_status = !strcmp(params->wait_method, "status");
+}
+
+void print_wait_stats(prog_params_t *params)
+{
+    for (int op = 0; op < WAIT_OPS; op++)
+    {
+        wait_stats_t *stats = &params->wait->ops[op];
+        if (!stats->waits)
+        {
+            continue;
+        }
+
+        printf("Busy waits (%s): %lu, %lu-%lu us, average %llu us, now expecting %lu us, "
+               "%.1f polls per wait\n", stats->name, stats->waits, stats->min_us,
+               stats->max_us, stats->total_us / stats->waits, stats->expected_us,
+               (float)stats->polls / stats->waits);
+    }
+}
+
+void wait_record(wait_stats_t *stats, unsigned long elapsed_us, unsigned long polls)
+{
+    if (!stats->waits || elapsed_us < stats->min_us)
+        stats->min_us = elapsed_us;
+    if (elapsed_us > stats->max_us)
+        stats->max_us = elapsed_us;
+    stats->waits++;
+    stats->polls += polls;
+    stats->total_us += elapsed_us;
+
+    long diff = (long)elapsed_us - (long)stats->expected_us;
+    stats->expected_us += diff / (1 << WAIT_AVERAGE_SHIFT);
+}
+
+int wait_while_busy(prog_params_t *params, wait_op_t op)
+{
+    nand_bus_t *bus = params->bus;
+    wait_engine_t *wait = params->wait;
+    wait_stats_t *stats = &wait->ops[op];
+    unsigned long poll_us = WAIT_POLL_MIN_US;
+    unsigned long polls = 0;
+    unsigned long elapsed_us;
+    int ready;
+
+    DBG("Checking for busy line...");
+
+    /* the operation starts once its command is out */
+    bus_sync(bus);
+    unsigned long long start_us = bus_now_us(bus);
+
+    if (stats->expected_us >= WAIT_SLEEP_MIN_US)
+    {
+        bus_usleep(bus, stats->expected_us * WAIT_SLEEP_PERCENT / 100);
+    }
+
+    if (wait->use_status)
+    {
+        latch_command(params, CMD_READSTATUS);
+    }
+
+    for (;;)
+    {
+        polls++;
+        if (wait->use_status)
+        {
+            unsigned char status_register;
+            latch_register(params, &status_register, 1);
+            ready = status_register & STATUSREG_IO6;
+        }
+        else
+        {
+            ready = controlbus_read_input(bus) & PIN_RDY;
+        }
+
+        elapsed_us = bus_now_us(bus) - start_us;
+        if (ready)
+        {
+            break;
+        }
+        else if (elapsed_us > stats->timeout_us)
+        {
+            fprintf(stderr, "Timeout waiting for %s to complete (%lu us)\n",
+                    stats->name, elapsed_us);
+            return -1;
+        }
+
+        DBGFLUSH(".");
+        bus_usleep(bus, poll_us);
+        poll_us = poll_us * 2 > WAIT_POLL_MAX_US ? WAIT_POLL_MAX_US : poll_us * 2;
+    }
+
+    if (wait->use_status && (op == WAIT_READ || op == WAIT_CACHE))
+    {
+        /* leave status output, back to data output */
+        latch_command(params, CMD_READ1[0]);
+    }
+
+    wait_record(stats, elapsed_us, polls);
+    DBG("  done\n");
+    return 0;
+}
+
+void read_id(prog_params_t *params, unsigned char *ID_register)
+{
+    latch_command(params, CMD_READID); /* command input operation; command: READ ID */
+
+    //unsigned char address[] = { 0x11, 0x22, 0x44, 0x88, 0xA5 };
+    //latch_address(address, 5);
+    unsigned char address[] = { 0x00 };
+    latch_address(params, address, 1); /* address input operation */
+
+    latch_register(params, ID_register, 5); /* data output operation */
+}
+
+/* CRC of the ONFI parameter page: CRC-16, polynomial 8005h, initial value 4F4Eh */
+unsigned int onfi_crc16(const unsigned char *data, unsigned int length)
+{
+    unsigned int crc = 0x4F4E;
+
+    for (unsigned int i = 0; i < length; i++)
+    {
+        crc ^= data[i] << 8;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+        }
+    }
+    return crc & 0xFFFF;
+}
+
+static unsigned int le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned int le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/* Copy a space padded parameter page string, trimmed */
+static void onfi_string(char *dst, const unsigned char *src, int length)
+{
+    while (length > 0 && src[length - 1] == ' ')
+    {
+        length--;
+    }
+    memcpy(dst, src, length);
+    dst[length] = '\0';
+}
+
+/*
+ * Read the ONFI parameter page (ECh), kept in three copies; the first one
+ * with a good CRC gives the geometry and the optional commands.
+ * 0 if found, 1 if the chip isn't ONFI, -1 on error.
+ */
+int chip_read_onfi(prog_params_t *params, chip_geometry_t *geo, unsigned int *features)
+{
+    unsigned char signature[4];
+    unsigned char pages[3 * ONFI_PARAM_PAGE_SIZE];
+    unsigned char address[] = { ONFI_ID_ADDRESS };
+
+    latch_command(params, CMD_READID);
+    latch_address(params, address, 1);
+    latch_register(params, signature, sizeof(signature));
+    if (memcmp(signature, "ONFI", sizeof(signature)))
+    {
+        return 1;
+    }
+
+    address[0] = 0x00;
+    latch_command(params, CMD_READPARAMETERPAGE);
+    latch_address(params, address, 1);
+    if (wait_while_busy(params, WAIT_READ))
+    {
+        return -1;
+    }
+    latch_register(params, pages, sizeof(pages));
+
+    for (int copy = 0; copy < 3; copy++)
+    {
+        unsigned char *p = pages + copy * ONFI_PARAM_PAGE_SIZE;
+        char manufacturer[13], model[21];
+
+        if (memcmp(p, "ONFI", 4) || onfi_crc16(p, 254) != le16(p + 254))
+        {
+            continue;
+        }
+
+        onfi_string(manufacturer, p + 32, 12);
+        onfi_string(model, p + 44, 20);
+        snprintf(geo->name, sizeof(geo->name), "%s %s", manufacturer, model);
+        geo->page_size_nospare = le32(p + 80);
+        geo->page_size = geo->page_size_nospare + le16(p + 84);
+        geo->pages_per_block = le32(p + 92);
+        geo->block_count = le32(p + 96) * (p[100] ? p[100] : 1); /* blocks per LUN, LUNs */
+        geo->row_cycles = p[101] & 0x0F;
+        geo->column_cycles = p[101] >> 4;
+        geo->planes = 1 << (p[113] & 0x0F); /* interleaved (plane) address bits */
+
+        unsigned int onfi_features = le16(p + 6);
+        unsigned int onfi_commands = le16(p + 8);
+        *features = 0;
+        if (onfi_commands & 0x0001)
+            *features |= CHIP_CACHE_PROGRAM;
+        if (onfi_commands & 0x0002)
+            *features |= CHIP_CACHE_READ;
+        if (onfi_commands & 0x0008)
+            *features |= CHIP_STATUS_ENHANCED;
+        if (onfi_commands & 0x0010)
+            *features |= CHIP_COPY_BACK;
+        if (onfi_commands & 0x0020)
+            *features |= CHIP_UNIQUE_ID;
+        if ((onfi_features & 0x0008) && (onfi_features & 0x0040)) /* program/erase, read */
+            *features |= CHIP_MULTI_PLANE;
+        return 0;
+    }
+
+    fprintf(stderr, "ONFI chip, but no parameter page copy has a good CRC\n");
+    return -1;
+}
+
+/*
+ * Identify the chip from its ID: its geometry goes to geometry, its optional
+ * commands to params->features. Chips that are neither ONFI nor in the chip
+ * database keep the default geometry, with the basic commands only.
+ */
+int chip_identify(prog_params_t *params, unsigned char *ID_register)
+{
+    chip_geometry_t geo = geometry;
+    chip_db_entry_t entry;
+    unsigned int features = 0;
+
+    /* output the retrieved ID register content */
+    printf("actual ID register:   0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
+        ID_register[0], ID_register[1], ID_register[2],
+        ID_register[3], ID_register[4] ); 
+
+    int ret = chip_read_onfi(params, &geo, &features);
+    if (ret < 0)
+    {
+        return -1;
+    }
+    else if (ret == 0)
+    {
+        printf("PASS: ONFI chip: %s\n", geo.name);
+    }
+    else if (chip_db_lookup(params, ID_register, &entry) == 0)
+    {
+        chip_db_geometry(&entry, ID_register, &geo);
+        features = entry.features;
+        if (ID_register[2] & 0x80) /* 3rd ID byte, bit 7: cache program */
+        {
+            features |= CHIP_CACHE_PROGRAM;
+        }
+        printf("PASS: chip: %s\n", geo.name);
+    }
+    else
+    {
+        printf("FAIL: unknown chip, keeping the default geometry\n");
+    }
+
+    if (geo.page_size > PAGE_SIZE_MAX || geo.page_size_nospare < 2048
+        || geo.page_size <= geo.page_size_nospare || geo.pages_per_block == 0
+        || geo.block_count == 0 || geo.planes == 0
+        || geo.column_cycles != 2 || geo.row_cycles < 2 || geo.row_cycles > 3)
+    {
+        fprintf(stderr, "Unsupported geometry: pages of %u+%u bytes, %u pages per block, "
+                        "%u blocks, %u+%u address cycles\n",
+                geo.page_size_nospare, geo.page_size - geo.page_size_nospare,
+                geo.pages_per_block, geo.block_count, geo.column_cycles, geo.row_cycles);
+        return -1;
+    }
+    if (geo.planes < 2 || geo.planes > PLANE_MAX)
+    {
+        /* multi-plane ops pair up blocks of PLANE_MAX planes */
+        features &= ~CHIP_MULTI_PLANE;
+    }
+
+    geo.page_count = geo.pages_per_block * geo.block_count;
+    geometry = geo;
+    params->features = features;
+    return 0;
+}
+
+/*
+ * Load a page into the chip's page register; the data is then ready to be
+ * clocked out with latch_register(), from the given column on.
+ */
+int read_page_start(prog_params_t *params, unsigned int page, unsigned int column)
+{
+    unsigned char addr_cycles[5];
+
+    DBG("Latching first command byte to read a page: ");
+    latch_command(params, CMD_READ1[0]);
+
+    get_address_cycle_map_x8_toshiba_page(page, column, addr_cycles);
+    DBG("Latching address cycles: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
+        addr_cycles[0], addr_cycles[1], /* column address */
+        addr_cycles[2], addr_cycles[3], addr_cycles[4]); /* row address */
+    latch_address(params, addr_cycles, ADDRESS_CYCLES);
+
+    DBG("Latching second command byte to read a page: ");
+    latch_command(params, CMD_READ1[1]);
+
+    // busy-wait for high level at the busy line
+    return wait_while_busy(params, WAIT_READ);
+}
+
+/*
+ * Cache read: move the page the array has loaded to the cache register for
+ * data output and, with 31h, have the array load the next page meanwhile,
+ * so tR is hidden behind clocking out the page. 3Fh ends the sequence.
+ */
+int read_cache_next(prog_params_t *params, int last)
+{
+    DBG("Latching cache read command byte: ");
+    latch_command(params, last ? CMD_READCACHE[1] : CMD_READCACHE[0]);
+
+    return wait_while_busy(params, WAIT_CACHE);
+}
+
+/*
+ * Random data output: move data output of the page just read to another
+ * column (05h, two column cycles, E0h) rather than clocking out the bytes
+ * before it.
+ */
+void read_column(prog_params_t *params, unsigned int page, unsigned int column)
+{
+    unsigned char addr_cycles[5];
+
+    latch_command(params, CMD_RANDOMDATAOUTPUT[0]);
+    get_address_cycle_map_x8_toshiba_page(page, column, addr_cycles);
+    latch_address(params, addr_cycles, geometry.column_cycles); /* column address */
+    latch_command(params, CMD_RANDOMDATAOUTPUT[1]);
+    bus_hold(params->bus, CHAN_CONTROLBUS, T_CCS);
+}
+
+/*
+ * Read count whole pages from page into buf, with cache reads if asked and
+ * there is more than one page; buf is ready on return.
+ */
+int read_pages(prog_params_t *params, unsigned int page, unsigned int count,
+               unsigned char *buf, int cache)
+{
+    cache = cache && count > 1;
+    if (cache && read_page_start(params, page, 0))
+    {
+        return -1;
+    }
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (cache ? read_cache_next(params, i + 1 == count)
+                  : read_page_start(params, page + i, 0))
+        {
+            return -1;
+        }
+        latch_register_deferred(params, buf + i * geometry.page_size, geometry.page_size);
+    }
+    return bus_sync(params->bus) ? -1 : 0;
+}
+
+/*
+ * Bad block table (-B).
+ *
+ * Factory bad blocks are marked by a non-FFh byte at the first spare column
+ * of their first or second page. A scan reads just that byte of both pages
+ * of every block, jumping to it with the column address of the page read,
+ * and keeps a bitmap per die in ~/BBT_FILE, one line each:
+ *   <ID, 10 hex digits> <unique ID, 32 hex digits, or -> <die> <blocks> <bitmap>
+ * The bitmap is in hex, block 0 being bit 0 of the first byte. Chips with a
+ * unique ID (EDh) are told apart by it; others only by their ID and die, so
+ * rescan when swapping two such chips. Dump, program and erase runs load the
+ * table of the chip and don't scan again; its markers are gone once a bad
+ * block is erased, so the table is the only copy left.
+ *
+ * Bad blocks are never read, programmed or erased. Physical dumps put 0xFF
+ * in their place so the image keeps its layout. With -L, the image is
+ * logical instead, like nandwrite and nanddump --bb=skipbad: its blocks are
+ * the good blocks of the range, in order, and bad ones are left out.
+ */
+#define BBT_MARKER_PAGES 2 /* pages of a block that may hold the marker */
+
+void bbt_path(char *path, size_t len)
+{
+    const char *home = getenv("HOME");
+    snprintf(path, len, "%s/%s", home ? home : ".", BBT_FILE);
+}
+
+/* 1 if the table marks the (all dies) block bad, 0 if good or no table */
+int bbt_bad(const unsigned char *bbt, unsigned int block)
+{
+    return bbt && (bbt[block / 8] >> (block % 8)) & 1;
+}
+
+/*
+ * Unique ID of the selected die as 32 hex digits, "-" if it has none. The
+ * chip returns 16 copies of the ID followed by its complement; the first
+ * copy that matches its complement is taken. Used even with -N, the table
+ * key mustn't depend on it.
+ */
+int read_unique_id(prog_params_t *params, char *uid, size_t len)
+{
+    unsigned char data[16 * 32];
+    unsigned char address[] = { 0x00 };
+
+    snprintf(uid, len, "-");
+    if (!(params->features & CHIP_UNIQUE_ID))
+    {
+        return 0;
+    }
+
+    latch_command(params, CMD_READUNIQUEID);
+    latch_address(params, address, 1);
+    if (wait_while_busy(params, WAIT_READ))
+    {
+        return -1;
+    }
+    latch_register(params, data, sizeof(data));
+
+    for (int copy = 0; copy < 16; copy++)
+    {
+        unsigned char *p = data + copy * 32;
+        int i;
+
+        for (i = 0; i < 16 && (p[i] ^ p[i + 16]) == 0xFF; i++)
+            ;
+        if (i < 16)
+        {
+            continue;
+        }
+        for (i = 0; i < 16 && 2 * i + 2 < (int)len; i++)
+        {
+            sprintf(uid + 2 * i, "%02X", p[i]);
+        }
+        return 0;
+    }
+
+    fprintf(stderr, "No unique ID copy matches its complement, keying the bad block table "
+                    "by the chip ID only\n");
+    return 0;
+}
+
+/* Table key of the selected die: "<ID> <unique ID> <die>" */
+int bbt_key(prog_params_t *params, unsigned char *ID_register, int die,
+            char *key, size_t len)
+{
+    char uid[33];
+
+    if (read_unique_id(params, uid, sizeof(uid)))
+    {
+        return -1;
+    }
+    snprintf(key, len, "%02X%02X%02X%02X%02X %s %d", ID_register[0], ID_register[1],
+             ID_register[2], ID_register[3], ID_register[4], uid, die);
+    return 0;
+}
+
+/* Line length of a die's table, bitmap included */
+static unsigned int bbt_line_max(void)
+{
+    return 2 * ((geometry.block_count + 7) / 8) + 128;
+}
+
+/* Replace (or add) the line of this die */
+int bbt_save(const char *key, const unsigned char *bbt, unsigned int first_block)
+{
+    char path[PATH_MAX], tmp_path[PATH_MAX + 4];
+    char line_id[16], line_uid[40], line_key[80];
+    int line_die;
+    unsigned int line_max = bbt_line_max();
+    char *line;
+    FILE *in, *out;
+
+    if ((line = malloc(line_max)) == NULL)
+    {
+        fprintf(stderr, "malloc error, size=%u\n", line_max);
+        return -1;
+    }
+
+    bbt_path(path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.new", path);
+    if ((out = fopen(tmp_path, "w")) == NULL)
+    {
+        fprintf(stderr, "Can't write the bad block table to %s\n", tmp_path);
+        free(line);
+        return -1;
+    }
+
+    if ((in = fopen(path, "r")) != NULL)
+    {
+        int line_start = 1;
+        int skip = 0;
+
+        while (fgets(line, line_max, in))
+        {
+            /* a line longer than the buffer comes in pieces, keep them together */
+            if (line_start)
+            {
+                skip = 0;
+                if (sscanf(line, "%15s %39s %d", line_id, line_uid, &line_die) == 3)
+                {
+                    snprintf(line_key, sizeof(line_key), "%s %s %d", line_id, line_uid, line_die);
+                    skip = !strcmp(line_key, key);
+                }
+            }
+            line_start = strchr(line, '\n') != NULL;
+            if (!skip)
+            {
+                fputs(line, out);
+            }
+        }
+        fclose(in);
+    }
+    free(line);
+
+    fprintf(out, "%s %u ", key, geometry.block_count);
+    for (unsigned int i = 0; i < geometry.block_count; i += 8)
+    {
+        unsigned char byte = 0;
+        for (unsigned int b = 0; b < 8 && i + b < geometry.block_count; b++)
+        {
+            byte |= bbt_bad(bbt, first_block + i + b) << b;
+        }
+        fprintf(out, "%02X", byte);
+    }
+    fprintf(out, "\n");
+
+    if (fclose(out) || rename(tmp_path, path))
+    {
+        fprintf(stderr, "Can't write the bad block table to %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Find the line of this die and set its bits in bbt; 0 if found */
+int bbt_load_die(const char *key, unsigned char *bbt, unsigned int first_block)
+{
+    char path[PATH_MAX];
+    char line_id[16], line_uid[40], line_key[80];
+    int line_die, pos;
+    unsigned int blocks;
+    unsigned int line_max = bbt_line_max();
+    char *line;
+    FILE *f;
+    int ret = -1;
+
+    bbt_path(path, sizeof(path));
+    if ((f = fopen(path, "r")) == NULL)
+    {
+        return -1;
+    }
+    if ((line = malloc(line_max)) == NULL)
+    {
+        fprintf(stderr, "malloc error, size=%u\n", line_max);
+        fclose(f);
+        return -1;
+    }
+
+    while (ret && fgets(line, line_max, f))
+    {
+        if (sscanf(line, "%15s %39s %d %u %n", line_id, line_uid, &line_die, &blocks, &pos) != 4)
+        {
+            continue;
+        }
+        snprintf(line_key, sizeof(line_key), "%s %s %d", line_id, line_uid, line_die);
+        if (strcmp(line_key, key) || blocks != geometry.block_count)
+        {
+            continue;
+        }
+
+        char *hex = line + pos;
+        unsigned int i;
+        for (i = 0; i < blocks; i += 8)
+        {
+            unsigned int byte;
+            if (sscanf(hex + i / 4, "%2x", &byte) != 1)
+            {
+                break;
+            }
+            for (unsigned int b = 0; b < 8 && i + b < blocks; b++)
+            {
+                if (byte & (1 << b))
+                {
+                    bbt[(first_block + i + b) / 8] |= 1 << ((first_block + i + b) % 8);
+                }
+            }
+        }
+        if (i < blocks)
+        {
+            fprintf(stderr, "Bad block table line of %s is cut short, ignored\n", key);
+            continue;
+        }
+        ret = 0;
+    }
+
+    free(line);
+    fclose(f);
+    return ret;
+}
+
+/* Print the bad blocks among count pages from first_page, if any */
+void bbt_report(prog_params_t *params, unsigned int first_page, unsigned int count)
+{
+    unsigned int bad = 0;
+    unsigned int first_block = first_page / geometry.pages_per_block;
+    unsigned int end_block = (first_page + count + geometry.pages_per_block - 1)
+                             / geometry.pages_per_block;
+
+    for (unsigned int block = first_block; block < end_block; block++)
+    {
+        if (bbt_bad(params->bad_blocks, block))
+        {
+            printf("%s%u", bad++ ? " " : "Bad blocks: ", block);
+        }
+    }
+    if (bad)
+    {
+        printf(" (%u)\n", bad);
+    }
+}
+
+/* Pages of good blocks in [first_page, end_page): the logical pages there */
+unsigned int bbt_good_pages(prog_params_t *params, unsigned int first_page, unsigned int end_page)
+{
+    unsigned int good = 0;
+
+    for (unsigned int page = first_page; page < end_page; )
+    {
+        unsigned int block = page / geometry.pages_per_block;
+        unsigned int next = (block + 1) * geometry.pages_per_block;
+
+        if (next > end_page)
+            next = end_page;
+        if (!bbt_bad(params->bad_blocks, block))
+            good += next - page;
+        page = next;
+    }
+    return good;
+}
+
+/*
+ * Physical pages from first_page that hold count logical pages (-L), up to
+ * the end of the last die
+ */
+unsigned int bbt_physical_count(prog_params_t *params, unsigned int first_page, unsigned int count)
+{
+    unsigned int end = params->dies * geometry.page_count;
+    unsigned int page = first_page;
+
+    while (count && page < end)
+    {
+        unsigned int block = page / geometry.pages_per_block;
+        unsigned int next = (block + 1) * geometry.pages_per_block;
+
+        if (!bbt_bad(params->bad_blocks, block))
+        {
+            if (next - page > count)
+                next = page + count;
+            count -= next - page;
+        }
+        page = next;
+    }
+    return page - first_page;
+}
+
+/*
+ * Load the table of every die into params->bad_blocks. Without a table for
+ * all of them, params->bad_blocks stays NULL and every block is taken as
+ * good, as before the table existed.
+ */
+int bbt_load(prog_params_t *params, unsigned char *ID_register)
+{
+    unsigned int blocks = params->dies * geometry.block_count;
+    unsigned char *bbt = calloc((blocks + 7) / 8, 1);
+    char key[80];
+
+    if (bbt == NULL)
+    {
+        fprintf(stderr, "malloc error, size=%u\n", (blocks + 7) / 8);
+        return -1;
+    }
+
+    for (int d = 0; d < params->dies; d++)
+    {
+        die_select(params->bus, d);
+        controlbus_update_output(params->bus);
+        if (bbt_key(params, ID_register, d, key, sizeof(key)))
+        {
+            free(bbt);
+            return -1;
+        }
+        if (bbt_load_die(key, bbt, d * geometry.block_count))
+        {
+            printf("No bad block table for %s, factory bad blocks aren't protected "
+                   "(scan them with -B)\n", key);
+            free(bbt);
+            return 0;
+        }
+    }
+
+    printf("Using the bad block table of ~/%s\n", BBT_FILE);
+    params->bad_blocks = bbt;
+    return 0;
+}
+
+/* Read the marker bytes of every block, save and print the table (-B) */
+int bbt_scan(prog_params_t *params, unsigned char *ID_register)
+{
+    unsigned int blocks = params->dies * geometry.block_count;
+    unsigned char *bbt = calloc((blocks + 7) / 8, 1);
+    unsigned char *markers = malloc(BBT_MARKER_PAGES * geometry.block_count);
+    char key[80];
+    int ret = 0;
+
+    if (bbt == NULL || markers == NULL)
+    {
+        fprintf(stderr, "malloc error, size=%u\n", BBT_MARKER_PAGES * geometry.block_count);
+        free(bbt);
+        free(markers);
+        return -1;
+    }
+
+    usb_stats_t stats_start = bus_stats(params->bus);
+
+    for (int d = 0; d < params->dies && !ret; d++)
+    {
+        unsigned int first = d * geometry.block_count;
+
+        die_select(params->bus, d);
+        controlbus_update_output(params->bus);
+        if (bbt_key(params, ID_register, d, key, sizeof(key)))
+        {
+            ret = -1;
+            break;
+        }
+        printf("Scanning the bad block markers of %s\n", key);
+
+        for (unsigned int i = 0; i < geometry.block_count && !ret; i++)
+        {
+            for (unsigned int p = 0; p < BBT_MARKER_PAGES; p++)
+            {
+                if (read_page_start(params, (first + i) * geometry.pages_per_block + p,
+                                    geometry.page_size_nospare))
+                {
+                    ret = -1;
+                    break;
+                }
+                latch_register_deferred(params, &markers[i * BBT_MARKER_PAGES + p], 1);
+            }
+        }
+        if (ret || bus_sync(params->bus))
+        {
+            ret = -1;
+            break;
+        }
+
+        for (unsigned int i = 0; i < BBT_MARKER_PAGES * geometry.block_count; i++)
+        {
+            unsigned int block = first + i / BBT_MARKER_PAGES;
+            if (markers[i] != 0xFF)
+            {
+                bbt[block / 8] |= 1 << (block % 8);
+            }
+        }
+        ret = bbt_save(key, bbt, first);
+    }
+
+    if (!ret)
+    {
+        params->bad_blocks = bbt;
+        bbt_report(params, 0, blocks * geometry.pages_per_block);
+        printf("%u blocks scanned, table saved to ~/%s\n", blocks, BBT_FILE);
+        print_usb_stats(params->bus, &stats_start, blocks * BBT_MARKER_PAGES);
+    }
+    else
+    {
+        free(bbt);
+    }
+    free(markers);
+    return ret;
+}
+
+/*
+ * Multi-plane read of a group of blocks, one per plane, starting at
+ * first_page: for each page offset, 32h queues the page of the first plane
+ * and 30h loads both at once; 06h-address-E0h then selects each plane's
+ * page register for data output, at the start of the -w window. Only
+ * clocks the pages out to group, the caller syncs the bus before using
+ * them.
+ */
+int dump_plane_group(prog_params_t *params, unsigned char *group, unsigned int first_page)
+{
+    unsigned char addr_cycles[5];
+
+    for (unsigned int offset = 0; offset < geometry.pages_per_block; offset++)
+    {
+        for (unsigned int plane = 0; plane < geometry.planes; plane++)
+        {
+            unsigned int page = first_page + plane * geometry.pages_per_block + offset;
+            int last = plane + 1 == geometry.planes;
+
+            latch_command(params, CMD_READ1[0]);
+            get_address_cycle_map_x8_toshiba_page(page, 0, addr_cycles);
+            latch_address(params, addr_cycles, ADDRESS_CYCLES);
+            latch_command(params, last ? CMD_READ1[1] : CMD_READMULTIPLANE);
+            if (wait_while_busy(params, last ? WAIT_READ : WAIT_PLANE))
+            {
+                return -1;
+            }
+        }
+
+        for (unsigned int plane = 0; plane < geometry.planes; plane++)
+        {
+            unsigned int page = first_page + plane * geometry.pages_per_block + offset;
+
+            latch_command(params, CMD_CHANGEREADCOLUMN[0]);
+            get_address_cycle_map_x8_toshiba_page(page, params->window_start, addr_cycles);
+            latch_address(params, addr_cycles, ADDRESS_CYCLES);
+            latch_command(params, CMD_CHANGEREADCOLUMN[1]);
+            bus_hold(params->bus, CHAN_CONTROLBUS, T_CCS);
+            latch_register_deferred(params, group + (page - first_page) * geometry.page_size,
+                                    params->window_length);
+        }
+    }
+    return 0;
+}
+
+int dump_write_page(FILE *fp, unsigned char *page, unsigned int length, unsigned int page_idx)
+{
+    if (!fwrite(page, length, 1, fp))
+    {
+        fprintf(stderr, "Error writing page %d to file, aborting\n", page_idx);
+        return -1;
+    }
+    // Flush every page so we can Ctrl-C happily; the dump is slow enough anyways.
+    fflush(fp);
+    return 0;
+}
+
+/* Columns of each page to dump, from -w, once the geometry is known */
+int window_setup(prog_params_t *params)
+{
+    if (params->window == NULL)
+    {
+        params->window_start = 0;
+        params->window_length = geometry.page_size;
+    }
+    else if (!strcmp(params->window, "main"))
+    {
+        params->window_start = 0;
+        params->window_length = geometry.page_size_nospare;
+    }
+    else if (!strcmp(params->window, "oob"))
+    {
+        params->window_start = geometry.page_size_nospare;
+        params->window_length = geometry.page_size - geometry.page_size_nospare;
+    }
+
+    if (params->window_start >= geometry.page_size
+        || params->window_length > geometry.page_size - params->window_start)
+    {
+        fprintf(stderr, "-w (window) must be within the %d columns of a page\n",
+                geometry.page_size);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Dump count pages from first_page, all on the selected die; only the -w
+ * window of each page goes out on the bus and into the file.
+ */
+int dump_range(prog_params_t *params, FILE *fp, unsigned int first_page, int count)
+{
+    unsigned int column = params->window_start;
+    unsigned int window = params->window_length;
+    unsigned int page_idx;
+    unsigned int page_idx_max;
+    uint32_t mem_address;
+    /* page content; double buffered so a page can be written to the file
+     * while the next one is still being read (async I/O) */
+    unsigned char mem_large_block[2][PAGE_SIZE_MAX];
+    //    unsigned int byte_offset;
+    //    unsigned int line_no;
+
+    /* sequential cache reads, when the chip has them; the first page is
+     * loaded the usual way */
+    int cache = count > 1 && (params->features & CHIP_CACHE_READ) && !params->basic_commands;
+    if (cache)
+    {
+        printf("Using cache reads\n");
+        if (read_page_start(params, first_page, 0))
+        {
+            return -1;
+        }
+    }
+
+    /* otherwise multi-plane reads, for the whole groups of blocks */
+    unsigned char *group = NULL;
+    if (!cache && (params->features & CHIP_MULTI_PLANE) && !params->basic_commands)
+    {
+        group = malloc(PLANE_GROUP_PAGES * geometry.page_size);
+        if (group == NULL)
+        {
+            fprintf(stderr, "malloc error, size=%d\n", PLANE_GROUP_PAGES * geometry.page_size);
+            return -1;
+        }
+        printf("Using multi-plane reads\n");
+    }
+    int unwritten = 0; /* the previous page is clocked out, not written yet */
+
+    // Start reading the data
+    page_idx_max = first_page + count;
+    for (page_idx = first_page; page_idx < page_idx_max; /* blocks per page * overall blocks */ page_idx++)
+    {
+      if (group && page_idx % PLANE_GROUP_PAGES == 0 && page_idx_max - page_idx >= PLANE_GROUP_PAGES)
+      {
+          printf("Reading data from pages %d-%d / %d (%.2f %%), multi-plane\n",
+                 page_idx, page_idx + PLANE_GROUP_PAGES - 1, page_idx_max,
+                 (float)page_idx/(float)page_idx_max * 100);
+          if (dump_plane_group(params, group, page_idx))
+          {
+              free(group);
+              return -1;
+          }
+          if (unwritten &&
+              dump_write_page(fp, mem_large_block[(page_idx - 1) & 1], window, page_idx - 1))
+          {
+              bus_sync(params->bus);
+              free(group);
+              return -1;
+          }
+          bus_sync(params->bus);
+          for (unsigned int i = 0; i < PLANE_GROUP_PAGES; i++)
+          {
+              if (dump_write_page(fp, group + i * geometry.page_size, window, page_idx + i))
+              {
+                  free(group);
+                  return -1;
+              }
+          }
+          unwritten = 0;
+          page_idx += PLANE_GROUP_PAGES - 1;
+          continue;
+      }
+
+      mem_address = page_idx * geometry.page_size_nospare; // start address
+      printf("Reading data from page %d / %d (%.2f %%), address: %08X\n", 
+             page_idx, page_idx_max, (float)page_idx/(float)page_idx_max * 100,
+             mem_address);
+      {
+          // this also completes the read of the previous page
+          if (cache ? read_cache_next(params, page_idx + 1 == page_idx_max)
+                    : read_page_start(params, page_idx, column))
+          {
+              free(group);
+              return -1;
+          }
+          if (cache && column)
+          {
+              /* cache reads output from column 0 */
+              read_column(params, page_idx, column);
+          }
+
+          DBG("Clocking out data block...\n");
+          latch_register_deferred(params, mem_large_block[page_idx & 1], window);
+      }
+
+//      // Dumping memory to console and file
+//      // 2112 bytes = 132 lines * 16 bytes/line
+//      for( line_no = 0; line_no < 132; line_no++ )
+//      {
+//          byte_offset = line_no * 16;
+//
+//          // Dumping memory to console
+//          // printf("%02X %02X %02X %02X %02X %02X %02X %02X  %02X %02X %02X %02X %02X %02X %02X %02X | ",
+//          //     mem_large_block[byte_offset+0], mem_large_block[byte_offset+1],
 //          //     mem_large_block[byte_offset+2], mem_large_block[byte_offset+3],
 //          //     mem_large_block[byte_offset+4], mem_large_block[byte_offset+5],
 //          //     mem_large_block[byte_offset+6], mem_large_block[byte_offset+7],
@@ -837,346 +3857,2155 @@ int dump_memory(prog_params_t *params)
 //          // printf("\n");
 //      }
 
-      // Dumping memory to file
-      if (!fwrite(mem_large_block, PAGE_SIZE, 1, fp))
-      {
-          fprintf(stderr, "Error writing page %d to file, aborting\n", page_idx);
-          fclose(fp);
-          return -1;
-      }
-      // Flush every page so we can Ctrl-C happily; the dump is slow enough anyways.
-      fflush(fp);
-      DBG("\n");
+      // Dumping the previous page to file while this one is clocked out
+      if (unwritten &&
+          dump_write_page(fp, mem_large_block[(page_idx - 1) & 1], window, page_idx - 1))
+      {
+          bus_sync(params->bus);
+          free(group);
+          return -1;
+      }
+      unwritten = 1;
+      DBG("\n");
+    }
+
+    bus_sync(params->bus);
+    free(group);
+    if (unwritten && dump_write_page(fp, mem_large_block[(page_idx_max - 1) & 1], window,
+                                 page_idx_max - 1))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Stand-in for the pages of a bad block in a physical dump */
+int dump_pad(FILE *fp, unsigned int pages, unsigned int length)
+{
+    unsigned char pad[PAGE_SIZE_MAX];
+
+    memset(pad, 0xFF, length);
+    for (unsigned int i = 0; i < pages; i++)
+    {
+        if (fwrite(pad, 1, length, fp) != length)
+        {
+            fprintf(stderr, "Write error on the dump file\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Dump count pages from first_page, all on the selected die, a run of good
+ * blocks at a time: bad blocks aren't read, they get 0xFF in the file, or
+ * nothing with -L.
+ */
+int dump_good_blocks(prog_params_t *params, FILE *fp, unsigned int first_page, unsigned int count)
+{
+    unsigned int end = first_page + count;
+    unsigned int page = first_page;
+
+    while (page < end)
+    {
+        unsigned int next = (page / geometry.pages_per_block + 1) * geometry.pages_per_block;
+        if (next > end)
+            next = end;
+
+        if (bbt_bad(params->bad_blocks, page / geometry.pages_per_block))
+        {
+            if (!params->logical && dump_pad(fp, next - page, params->window_length))
+            {
+                return -1;
+            }
+            page = next;
+            continue;
+        }
+
+        while (next < end && !bbt_bad(params->bad_blocks, next / geometry.pages_per_block))
+        {
+            next = next + geometry.pages_per_block < end ? next + geometry.pages_per_block : end;
+        }
+        if (dump_range(params, fp, page, next - page))
+        {
+            return -1;
+        }
+        page = next;
+    }
+    return 0;
+}
+
+/*
+ * Dump params->count pages from params->start_page to params->filename,
+ * a die at a time. With -L, params->count is in pages of good blocks.
+ */
+int dump_memory(prog_params_t *params)
+{
+    FILE *fp;
+
+    fp = fopen(params->filename, "wb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Could not open file: %s\n", params->filename);
+        return -1;
+    }
+    printf("Opened output file: %s\n", params->filename);
+
+    int count = params->count;
+    if (count == 0)
+    {
+        count = params->dies * geometry.page_count - params->start_page;
+    }
+    else if (params->logical)
+    {
+        count = bbt_physical_count(params, params->start_page, count);
+    }
+    bbt_report(params, params->start_page, count);
+
+    usb_stats_t stats_start = bus_stats(params->bus);
+
+    for (int d = 0; d < params->dies; d++)
+    {
+        unsigned int first;
+        unsigned int pages = die_range(d, geometry.page_count, params->start_page, count, &first);
+        if (!pages)
+        {
+            continue;
+        }
+
+        die_select(params->bus, d);
+        controlbus_update_output(params->bus);
+        if (dump_good_blocks(params, fp, first, pages))
+        {
+            fclose(fp);
+            return -1;
+        }
+    }
+
+    // Finished reading the data
+    print_usb_stats(params->bus, &stats_start, bbt_good_pages(params, params->start_page,
+                                                              params->start_page + count));
+    printf("Closing binary dump file...\n");
+    fclose(fp);
+
+    return 0;
+}
+
+/**
+ * BlockErase
+ *
+ * "The Erase operation is done on a block basis.
+ * Block address loading is accomplished in three cycles initiated by an Erase Setup command (60h).
+ * Only address A18 to A29 is valid while A12 to A17 is ignored (x8).
+ *
+ * The Erase Confirm command (D0h) following the block address loading initiates the internal erasing process.
+ * This two step sequence of setup followed by execution command ensures that memory contents are not
+ * accidentally erased due to external noise conditions.
+ *
+ * At the rising edge of WE after the erase confirm command input,
+ * the internal write controller handles erase and erase verify.
+ *
+ * Once the erase process starts, the Read Status Register command may be entered to read the status register.
+ * The system controller can detect the completion of an erase by monitoring the R/B output,
+ * or the Status bit (I/O 6) of the Status Register.
+ * Only the Read Status command and Reset command are valid while erasing is in progress.
+ * When the erase operation is completed, the Write Status Bit (I/O 0) may be checked."
+ */
+/*
+ * Erase count blocks starting at block; more than one is a multi-plane
+ * erase, the blocks must then be in different planes (see geometry.planes).
+ * erase_blocks_start() only issues the commands, erase_blocks_check() looks
+ * at the status once the chip is ready again.
+ */
+int erase_blocks_start(prog_params_t *params, unsigned int block, unsigned int count)
+{
+    uint32_t mem_address;
+    unsigned int page;
+    unsigned char addr_cycles[5];
+
+    /* remove write protection */
+    controlbus_pin_set(params->bus, PIN_nWP, ON);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        /* calculate memory address */
+        page = (block + i) * geometry.pages_per_block;
+        mem_address = geometry.page_size_nospare * page; 
+
+        DBG("Latching first command byte to erase a block...\n");
+        latch_command(params, CMD_BLOCKERASE[0]); /* block erase setup command */
+
+        DBG("Erasing block %u at memory address 0x%08X (page %u)\n", block + i, mem_address, page);
+        get_address_cycle_map_x8_toshiba_page(page, 0, addr_cycles);
+        DBG("  Address cycles are (but: will take only cycles 3..5) : 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
+            addr_cycles[0], addr_cycles[1], /* column address */
+            addr_cycles[2], addr_cycles[3], addr_cycles[4] ); /* row address */
+
+        DBG("Latching page(row) address (%u bytes)...\n", geometry.row_cycles);
+        latch_address(params, addr_cycles + geometry.column_cycles, geometry.row_cycles);
+
+        if (i + 1 < count)
+        {
+            /* queue it, the last block's D0h erases them all */
+            DBG("Latching command byte to queue a multi-plane erase...\n");
+            latch_command(params, CMD_BLOCKERASEMULTIPLANE);
+            if (wait_while_busy(params, WAIT_PLANE))
+            {
+                controlbus_pin_set(params->bus, PIN_nWP, OFF);
+                return 1;
+            }
+            continue;
+        }
+
+        DBG("Latching second command byte to erase a block...\n");
+        latch_command(params, CMD_BLOCKERASE[1]);
+    }
+
+    /* tWB: WE High to Busy is 100 ns -> ignore it here as it takes some time for the next command to execute */
+    return 0;
+}
+
+int erase_blocks_check(unsigned int block, unsigned int count, unsigned char status_register)
+{
+    if (status_register & STATUSREG_IO0)
+    {
+        fprintf(stderr, "Failed to erase block %u%s, status register=%02X.\n", block,
+                count > 1 ? " (or the other blocks of the multi-plane erase)" : "",
+                status_register);
+        return 1;
+    }
+
+    if (count > 1)
+        printf("  Successfully erased blocks %u-%u.\n", block, block + count - 1);
+    else
+        printf("  Successfully erased block %u.\n", block);
+    return 0;
+}
+
+int erase_blocks(prog_params_t *params, unsigned int block, unsigned int count)
+{
+    if (erase_blocks_start(params, block, count))
+    {
+        return 1;
+    }
+
+    // busy-wait for high level at the busy line
+    if (wait_while_busy(params, WAIT_ERASE))
+    {
+        controlbus_pin_set(params->bus, PIN_nWP, OFF);
+        return 1;
+    }
+
+    /* Read status */
+    DBG("Latching command byte to read status...\n");
+    latch_command(params, CMD_READSTATUS);
+
+    unsigned char status_register;
+    latch_register(params, &status_register, 1); /* data output operation */
+    DBG("Status register content:   0x%02X\n", status_register);
+
+    /* activate write protection again */
+    controlbus_pin_set(params->bus, PIN_nWP, OFF);
+
+    return erase_blocks_check(block, count, status_register);
+}
+
+int latch_data_out(prog_params_t *params, unsigned char data[], unsigned int length)
+{
+    nand_bus_t *bus = params->bus;
+
+    if (bus->ops->write_cycles)
+    {
+        return bus->ops->write_cycles(bus, 0, data, length);
+    }
+
+    for (unsigned int k = 0; k < length; k++)
+    {
+        // toggle nWE low
+        controlbus_pin_set(bus, PIN_nWE, OFF);
+        controlbus_update_output(bus);
+        bus_hold(bus, CHAN_CONTROLBUS, T_WP);
+
+        // change I/O pins
+        iobus_set_value(bus, data[k]);
+        iobus_update_output(bus);
+        bus_hold(bus, CHAN_IOBUS, T_DS);
+
+        // toggle nWE back high (acts as clock to latch the current address byte!)
+        controlbus_pin_set(bus, PIN_nWE, ON);
+        controlbus_update_output(bus);
+        bus_hold(bus, CHAN_CONTROLBUS, T_WH);
+    }
+
+    return 0;
+}
+
+/*
+ * Sparse data input: 80h clears the page register to FFh, so only the bytes
+ * that aren't erased need loading. The first run goes to the column of the
+ * 80h address cycles, each following one to a new column set with random
+ * data input (85h). Erased runs shorter than SPARSE_MIN_GAP are loaded as
+ * they are, jumping over them would cost about as many bus cycles.
+ */
+#define SPARSE_MIN_GAP 16
+
+/* First column from the given one that isn't erased, geometry.page_size if none */
+unsigned int next_programmed_column(unsigned char *data, unsigned int column)
+{
+    while (column < geometry.page_size && data[column] == 0xFF)
+    {
+        column++;
+    }
+    return column;
+}
+
+int latch_page_data(prog_params_t *params, unsigned int page, unsigned char *data,
+                    unsigned int column)
+{
+    unsigned char addr_cycles[5];
+
+    for (;;)
+    {
+        /* extend the run over erased gaps too short to jump */
+        unsigned int end = column + 1;
+        unsigned int next = next_programmed_column(data, end);
+        while (next < geometry.page_size && next - end < SPARSE_MIN_GAP)
+        {
+            end = next + 1;
+            next = next_programmed_column(data, end);
+        }
+
+        DBG("  Loading columns %u-%u\n", column, end - 1);
+        latch_data_out(params, data + column, end - column);
+        if (next == geometry.page_size)
+        {
+            return 0;
+        }
+
+        column = next;
+        latch_command(params, CMD_CHANGEWRITECOLUMN);
+        get_address_cycle_map_x8_toshiba_page(page, column, addr_cycles);
+        latch_address(params, addr_cycles, geometry.column_cycles); /* column address */
+    }
+}
+
+/**
+ * Page Program
+ *
+ * "The device is programmed by page.
+ * The number of consecutive partial page programming operation within the same page
+ * without an intervening erase operation must not exceed 8 times.
+ *
+ * The addressing should be done on each pages in a block.
+ * A page program cycle consists of a serial data loading period in which up to 2112 bytes of data
+ * may be loaded into the data register, followed by a non-volatile programming period where the loaded data
+ * is programmed into the appropriate cell.
+ *
+ * The serial data loading period begins by inputting the Serial Data Input command (80h),
+ * followed by the five cycle address inputs and then serial data.
+ *
+ * The bytes other than those to be programmed do not need to be loaded.
+ *
+ * The device supports random data input in a page.
+ * The column address of next data, which will be entered, may be changed to the address which follows
+ * random data input command (85h).
+ * Random data input may be operated multiple times regardless of how many times it is done in a page.
+ *
+ * The Page Program confirm command (10h) initiates the programming process.
+ * Writing 10h alone without pre-viously entering the serial data will not initiate the programming process.
+ * The internal write state controller automatically executes the algorithms and timings necessary for
+ * program and verify, thereby freeing the system controller for other tasks.
+ * Once the program process starts, the Read Status Register command may be entered to read the status register.
+ * The system controller can detect the completion of a program cycle by monitoring the R/B output,
+ * or the Status bit (I/O 6) of the Status Register.
+ * Only the Read Status command and Reset command are valid while programming is in progress.
+ *
+ * When the Page Program is complete, the Write Status Bit (I/O 0) may be checked.
+ * The internal write verify detects only errors for "1"s that are not successfully programmed to "0"s.
+ *
+ * The command register remains in Read Status command mode until another valid command is written to the
+ * command register.
+ */
+/*
+ * Page program is split in two so the host can do other work (like reading
+ * the next page from the input file) while the data is on the wire and the
+ * chip is busy: program_page_start() loads the data and confirms, handing
+ * everything to the USB layer without waiting; program_page_finish() waits
+ * for the chip and checks the status.
+ *
+ * Consecutive pages of a block can be cache programmed: all but the last
+ * one are confirmed with 15h instead of 10h, and the chip takes the next
+ * page's data while it is still programming the previous one. Only the
+ * result of the page before is known then (I/O1), and write protection
+ * stays off until the 10h that ends the run.
+ *
+ * A step can also hold one page per plane, at the same offset of blocks in
+ * different planes, for a multi-plane program: all but the last page are
+ * queued with 11h, and the last confirm programs them all at once.
+ */
+typedef enum {
+    PROGRAM_PAGE=0,      /* 80h-10h */
+    PROGRAM_CACHE=1,     /* 80h-15h, more pages follow */
+    PROGRAM_CACHE_END=2, /* 80h-10h, last page of a cache program run */
+} program_mode_t;
+
+typedef struct _program_step {
+    unsigned int count;              /* pages, in different planes */
+    unsigned int page[PLANE_MAX];
+    unsigned char *data[PLANE_MAX];
+} program_step_t;
+
+int program_page_start(prog_params_t *params, program_step_t *step, program_mode_t mode)
+{
+    uint32_t mem_address;
+    unsigned char addr_cycles[5];
+
+    /* remove write protection */
+    controlbus_pin_set(params->bus, PIN_nWP, ON);
+
+    for (unsigned int i = 0; i < step->count; i++)
+    {
+        unsigned int page = step->page[i];
+
+        mem_address = page* geometry.page_size_nospare;
+        printf("Writing data to page %u, memory address 0x%02X\n", page, mem_address);
+
+        /* start loading at the first byte that isn't erased */
+        unsigned int column = 0;
+        if (!params->basic_commands)
+        {
+            column = next_programmed_column(step->data[i], 0);
+            if (column == geometry.page_size)
+            {
+                column = 0; /* all erased, still load a byte for the confirm to program */
+            }
+        }
+
+        get_address_cycle_map_x8_toshiba_page(page, column, addr_cycles);
+        DBG("  Address cycles are: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
+            addr_cycles[0], addr_cycles[1], /* column address */
+            addr_cycles[2], addr_cycles[3], addr_cycles[4]); /* row address */
+
+        DBG("Latching first command byte to write a page (page size is %d)...\n",
+                geometry.page_size);
+        latch_command(params, CMD_PAGEPROGRAM[0]); /* Serial Data Input command */
+
+        DBG("Latching address cycles...\n");
+        latch_address(params, addr_cycles, ADDRESS_CYCLES);
+
+        DBG("Latching out the data of the page...\n");
+        if (params->basic_commands)
+        {
+            latch_data_out(params, step->data[i], geometry.page_size);
+        }
+        else
+        {
+            latch_page_data(params, page, step->data[i], column);
+        }
+
+        DBG("Latching second command byte to write a page...\n");
+        if (i + 1 < step->count)
+        {
+            latch_command(params, CMD_PAGEPROGRAMMULTIPLANE); /* queued for the next plane */
+            if (wait_while_busy(params, WAIT_PLANE))
+            {
+                return 1;
+            }
+        }
+        else if (mode == PROGRAM_CACHE)
+        {
+            latch_command(params, CMD_CACHEPROGRAM); /* Cache Program confirm command */
+        }
+        else
+        {
+            latch_command(params, CMD_PAGEPROGRAM[1]); /* Page Program confirm command command */
+        }
+    }
+
+    bus_flush(params->bus);
+    return 0;
+}
+
+/* Check the status read once the chip is ready after a step */
+int program_page_check(program_step_t *step, program_mode_t mode, unsigned char status_register)
+{
+    unsigned int page = step->page[0];
+
+    /* output the retrieved status register content */
+    printf("  Status register content:   0x%02X\n", status_register);
+
+    if (mode != PROGRAM_PAGE && (status_register & STATUSREG_IO1))
+    {
+        fprintf(stderr, "Failed to program the page(s) before page %u.\n", page);
+        return 1;
+    }
+    if (mode == PROGRAM_CACHE)
+    {
+        /* this step is still being programmed */
+        return 0;
+    }
+
+    if (status_register & STATUSREG_IO0)
+    {
+        fprintf(stderr, "Failed to program page %u%s.\n", page,
+                step->count > 1 ? " (or the other pages of the multi-plane program)" : "");
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < step->count; i++)
+    {
+        printf("  => Successfully programmed page %u.\n", step->page[i]);
+    }
+    return 0;
+}
+
+int program_page_finish(prog_params_t *params, program_step_t *step, program_mode_t mode)
+{
+    // busy-wait for high level at the busy line
+    if (wait_while_busy(params, mode == PROGRAM_CACHE ? WAIT_CACHE_PROGRAM : WAIT_PROGRAM))
+    {
+        controlbus_pin_set(params->bus, PIN_nWP, OFF);
+        return 1;
+    }
+
+    /* Read status */
+    DBG("Latching command byte to read status...\n");
+    latch_command(params, CMD_READSTATUS);
+
+    unsigned char status_register;
+    latch_register(params, &status_register, 1); /* data output operation */
+
+    int ret = program_page_check(step, mode, status_register);
+    if (ret || mode != PROGRAM_CACHE)
+    {
+        /* activate write protection again */
+        controlbus_pin_set(params->bus, PIN_nWP, OFF);
+    }
+    return ret;
+}
+
+int program_page(prog_params_t *params, unsigned int page, unsigned char* data)
+{
+    program_step_t step = { .count = 1, .page = { page }, .data = { data } };
+
+    if (program_page_start(params, &step, PROGRAM_PAGE))
+    {
+        controlbus_pin_set(params->bus, PIN_nWP, OFF);
+        return 1;
+    }
+    return program_page_finish(params, &step, PROGRAM_PAGE);
+}
+
+/*
+ * Return 1 if the given buffer is all the same value, 0 if at least one byte
+ * is different. Goes 64 bits at a time, ORing the differences over a chunk
+ * with no branch inside, which the compiler turns into vector compares;
+ * whole pages and blocks get checked this way (-z).
+ */
+#define ALL_VAL_CHUNK 256
+
+int is_all_val(unsigned char *b, int len, unsigned char val)
+{
+    uint64_t pattern = 0x0101010101010101ULL * val;
+    int i = 0;
+
+    for (; i + ALL_VAL_CHUNK <= len; i += ALL_VAL_CHUNK)
+    {
+        uint64_t diff = 0;
+        for (int j = 0; j < ALL_VAL_CHUNK; j += sizeof(uint64_t))
+        {
+            uint64_t word;
+            memcpy(&word, b + i + j, sizeof(word));
+            diff |= word ^ pattern;
+        }
+        if (diff)
+        {
+            return 0;
+        }
+    }
+    for (; i < len; i++)
+    {
+        if (b[i] != val)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Skip pages that are purely 0xFFs (NAND only programs bits to 0)
+ * HACK: also skip pages that are purely 0x00s as these might have come 
+ *   from bad blocks, and flashing them would turn possibly good blocks
+ *   into marked-as-bad blocks
+ * Pages of the blocks the bad block table (-B) marks bad are skipped by
+ * program_stream_read(); without a table, factory bad blocks get written
+ * over like any other, possibly losing their markers.
+ */
+int program_page_wanted(unsigned char *page)
+{
+    return !is_all_val(page, geometry.page_size, 0xFF) && !is_all_val(page, geometry.page_size, 0x00);
+}
+
+/*
+ * Die scheduler (-D).
+ *
+ * Programs and erases run as a stream of operations per die. Whenever a die
+ * is ready, its next operation goes out, so the bus loads one die while the
+ * others are busy programming or erasing. The dies share the RDY line, so
+ * it can't tell which one is ready: the status of each busy die is polled
+ * instead, with Read Status Enhanced (78h, addressed to the row of the
+ * die's operation) or 70h on chips without it, all clocked out before a
+ * single bus_sync(). Write protection stays off for the whole run.
+ */
+#define DIE_TIMEOUT_US 500000 /* longest an operation can keep a die busy */
+
+typedef struct _die_stream {
+    int (*start)(prog_params_t *params, void *ctx, unsigned int *page); /* 1: done, -1: error */
+    int (*check)(prog_params_t *params, void *ctx, unsigned char status);
+    void *ctx;
+    int active;                 /* has operations left */
+    int busy;                   /* an operation is in flight */
+    unsigned int page;          /* its page, for 78h */
+    unsigned char status;
+    unsigned long long start_us;
+} die_stream_t;
+
+/* Status of every busy die, read back to back in one round trip */
+void die_poll(prog_params_t *params, die_stream_t *streams)
+{
+    nand_bus_t *bus = params->bus;
+    unsigned char addr_cycles[5];
+
+    for (int d = 0; d < params->dies; d++)
+    {
+        if (!streams[d].busy)
+        {
+            continue;
+        }
+
+        die_select(bus, d);
+        controlbus_update_output(bus);
+        if (params->features & CHIP_STATUS_ENHANCED)
+        {
+            latch_command(params, CMD_READSTATUSENHANCED);
+            get_address_cycle_map_x8_toshiba_page(streams[d].page, 0, addr_cycles);
+            latch_address(params, addr_cycles + geometry.column_cycles, geometry.row_cycles); /* row address */
+        }
+        else
+        {
+            latch_command(params, CMD_READSTATUS);
+        }
+        latch_register_deferred(params, &streams[d].status, 1);
+    }
+    bus_sync(bus);
+}
+
+int run_dies(prog_params_t *params, die_stream_t *streams)
+{
+    nand_bus_t *bus = params->bus;
+    unsigned long poll_us = WAIT_POLL_MIN_US;
+    unsigned long polls = 0;
+    int use_status = params->wait->use_status;
+    int ret = 0;
+
+    /* short waits within an operation (multi-plane queueing) can't go by
+     * RDY either while the other dies are busy */
+    params->wait->use_status = 1;
+
+    for (;;)
+    {
+        int busy = 0, active = 0, started = 0;
+
+        for (int d = 0; d < params->dies; d++)
+        {
+            busy |= streams[d].busy;
+        }
+        if (busy)
+        {
+            die_poll(params, streams);
+            polls++;
+        }
+
+        for (int d = 0; d < params->dies && !ret; d++)
+        {
+            die_stream_t *s = &streams[d];
+
+            if (s->busy)
+            {
+                if (!(s->status & STATUSREG_IO6))
+                {
+                    active = 1;
+                    if (bus_now_us(bus) - s->start_us > DIE_TIMEOUT_US)
+                    {
+                        fprintf(stderr, "Timeout waiting for die %d\n", d);
+                        ret = -1;
+                    }
+                    continue;
+                }
+
+                s->busy = 0;
+                if (s->check(params, s->ctx, s->status))
+                {
+                    ret = -1;
+                    break;
+                }
+            }
+            if (!s->active)
+            {
+                continue;
+            }
+
+            die_select(bus, d);
+            controlbus_update_output(bus);
+            int r = s->start(params, s->ctx, &s->page);
+            if (r < 0)
+            {
+                ret = -1;
+            }
+            else if (r > 0)
+            {
+                s->active = 0;
+            }
+            else
+            {
+                s->busy = 1;
+                s->start_us = bus_now_us(bus);
+                active = started = 1;
+            }
+        }
+
+        if (ret || !active)
+        {
+            break;
+        }
+        if (started)
+        {
+            poll_us = WAIT_POLL_MIN_US;
+        }
+        else
+        {
+            /* every die is busy */
+            bus_usleep(bus, poll_us);
+            poll_us = poll_us * 2 > WAIT_POLL_MAX_US ? WAIT_POLL_MAX_US : poll_us * 2;
+        }
+    }
+
+    /* activate write protection again */
+    controlbus_pin_set(bus, PIN_nWP, OFF);
+    die_select(bus, 0);
+    controlbus_update_output(bus);
+    params->wait->use_status = use_status;
+
+    printf("Interleaved over %d dies, %lu status polls\n", params->dies, polls);
+    return ret;
+}
+
+/*
+ * Program stream: pages of the input file going to a range of the flash.
+ * The input is read a group of pages at a time: the rest of the current
+ * block or, for multi-plane programs, a block per plane. A group becomes
+ * steps (a page, or a page per plane) that are programmed in order, cache
+ * programmed up to the last one; the next group is read from the file while
+ * the chip programs that last step.
+ */
+typedef struct _program_stream {
+    FILE *f;
+    unsigned char *buf;
+    unsigned int page_idx;      /* next page to read from the file */
+    unsigned int end_page;
+    program_step_t *steps;      /* PLANE_GROUP_PAGES of them */
+    unsigned int step_count;    /* steps of the group in buf */
+    unsigned int step_next;
+    int pending;                /* a step was started and not finished yet */
+    program_step_t pending_step;
+    program_mode_t pending_mode; /* mode of the last step started */
+    int cache;
+    int multi_plane;
+    const unsigned char *bad_blocks; /* see bbt_bad() */
+    int logical;                /* bad blocks don't take input pages (-L) */
+    int n, programmed, skipped; /* pages read from the file, programmed, skipped */
+    int bad;                    /* pages skipped, in bad blocks */
+    /* -V: buf holds two groups, the one being programmed and the previous
+     * one, which is read back into readback once its last step is done */
+    int verify;
+    int verify_cache;           /* read back with cache reads */
+    unsigned char *readback;
+    unsigned int half;          /* group of buf the next read goes to */
+    unsigned char *group_data;  /* group read last: its data, first page, pages */
+    unsigned int group_first;
+    unsigned int group_pages;
+    int verify_due;             /* the previous group is programmed, to verify */
+    unsigned char *verify_data;
+    unsigned int verify_first;
+    unsigned int verify_pages;
+    int verified, verify_failed; /* pages read back, pages that differ */
+    unsigned long verify_bits;  /* bits that differ */
+} program_stream_t;
+
+int program_stream_open(prog_params_t *params, program_stream_t *s,
+                        unsigned int first_page, unsigned int count)
+{
+    memset(s, 0, sizeof(*s));
+
+    if ((s->f = fopen(params->input_file, "rb")) == NULL)
+    {
+        fprintf(stderr, "Error: can't open input data file: %s\n", params->input_file);
+        return -1;
+    }
+
+    s->verify = params->verify;
+    s->buf = malloc((s->verify ? 2 : 1) * PLANE_GROUP_PAGES * geometry.page_size);
+    s->steps = malloc(PLANE_GROUP_PAGES * sizeof(*s->steps));
+    if (s->verify)
+    {
+        s->readback = malloc(PLANE_GROUP_PAGES * geometry.page_size);
+    }
+    if (s->buf == NULL || s->steps == NULL || (s->verify && s->readback == NULL))
+    {
+        fprintf(stderr, "malloc error, size=%d\n", PLANE_GROUP_PAGES * geometry.page_size);
+        free(s->buf);
+        free(s->steps);
+        free(s->readback);
+        fclose(s->f);
+        return -1;
+    }
+
+    /* with -L, the input pages before this stream are those of the good blocks */
+    unsigned int before = params->logical ? bbt_good_pages(params, params->start_page, first_page)
+                                          : first_page - params->start_page;
+    long skip_bytes = (long)(params->input_skip + before) * geometry.page_size;
+    if (skip_bytes)
+    {
+        fseek(s->f, skip_bytes, SEEK_SET);
+        if (ftell(s->f) != skip_bytes)
+        {
+            fprintf(stderr, "Seek failed, aborting\n");
+            free(s->buf);
+            free(s->steps);
+            free(s->readback);
+            fclose(s->f);
+            return -1;
+        }
+    }
+
+    s->page_idx = first_page;
+    s->end_page = first_page + count;
+    s->pending_mode = PROGRAM_PAGE;
+    s->cache = (params->features & CHIP_CACHE_PROGRAM) && !params->basic_commands;
+    s->multi_plane = (params->features & CHIP_MULTI_PLANE) && !params->basic_commands;
+    s->bad_blocks = params->bad_blocks;
+    s->logical = params->logical;
+    s->verify_cache = (params->features & CHIP_CACHE_READ) && !params->basic_commands;
+    return 0;
+}
+
+void program_stream_close(program_stream_t *s)
+{
+    free(s->buf);
+    free(s->steps);
+    free(s->readback);
+    fclose(s->f);
+}
+
+/* Read the next group from the file and make its steps; 0 at the end */
+unsigned int program_stream_read(program_stream_t *s)
+{
+    /* with -L, the input goes on in the next good block */
+    while (s->logical && s->page_idx < s->end_page
+           && bbt_bad(s->bad_blocks, s->page_idx / geometry.pages_per_block))
+    {
+        unsigned int next = (s->page_idx / geometry.pages_per_block + 1) * geometry.pages_per_block;
+        if (next > s->end_page)
+            next = s->end_page;
+        s->bad += next - s->page_idx;
+        s->page_idx = next;
+    }
+
+    unsigned int first = s->page_idx;
+    unsigned int left = s->end_page - first;
+    unsigned int planes = 1;
+    unsigned int group_pages = geometry.pages_per_block - first % geometry.pages_per_block;
+
+    s->step_count = 0;
+    s->step_next = 0;
+    if (left == 0)
+    {
+        return 0;
+    }
+
+    /* a plane group with a bad block goes a block at a time */
+    int group_good = 1;
+    for (unsigned int b = 0; b < geometry.planes; b++)
+    {
+        if (bbt_bad(s->bad_blocks, first / geometry.pages_per_block + b))
+            group_good = 0;
+    }
+
+    if (s->multi_plane && first % PLANE_GROUP_PAGES == 0 && left >= PLANE_GROUP_PAGES
+        && group_good)
+    {
+        planes = geometry.planes;
+        group_pages = PLANE_GROUP_PAGES;
+    }
+    else if (group_pages > left)
+    {
+        group_pages = left;
+    }
+
+    unsigned char *buf = s->buf + s->half * PLANE_GROUP_PAGES * geometry.page_size;
+    unsigned int got = fread(buf, geometry.page_size, group_pages, s->f);
+    if (s->verify)
+    {
+        s->half ^= 1;
+    }
+    s->group_data = buf;
+    s->group_first = first;
+    s->group_pages = got;
+    s->n += got;
+    s->page_idx += got;
+    if (got < group_pages)
+    {
+        /* end of the input file */
+        s->end_page = s->page_idx;
+    }
+
+    /* a step per page offset, with the pages to program on each plane */
+    unsigned int offsets = group_pages / planes;
+    for (unsigned int k = 0; k < offsets; k++)
+    {
+        program_step_t *step = &s->steps[s->step_count];
+        step->count = 0;
+        for (unsigned int plane = 0; plane < planes; plane++)
+        {
+            unsigned int i = plane * offsets + k;
+            if (i >= got)
+            {
+                continue;
+            }
+            if (bbt_bad(s->bad_blocks, (first + i) / geometry.pages_per_block))
+            {
+                s->bad++;
+                continue;
+            }
+            if (!program_page_wanted(buf + i * geometry.page_size))
+            {
+                s->skipped++;
+                continue;
+            }
+            step->page[step->count] = first + i;
+            step->data[step->count] = buf + i * geometry.page_size;
+            step->count++;
+        }
+        if (step->count)
+        {
+            s->step_count++;
+        }
+    }
+
+    return got;
+}
+
+void program_stream_error(prog_params_t *params, program_stream_t *s)
+{
+    fprintf(stderr, "Program error on page=%d (0x%x), file buf %d; "
+                    "aborting programming\n", 
+            s->pending_step.page[0], s->pending_step.page[0],
+            s->pending_step.page[0] - params->start_page);
+}
+
+/*
+ * Verify (-V): the status register only tells a page that failed to program
+ * bits to 0, so once the last step of a group is done, the group's pages
+ * are read back, with cache reads where the chip has them, and compared
+ * with what was sent; the mismatching columns and bits are reported. The
+ * group's data stays in its half of buf while the next group is read into
+ * the other one.
+ */
+#define VERIFY_COLUMNS_SHOWN 8
+
+/* Compare a programmed page with its data; bits that differ */
+unsigned int verify_page(unsigned int page, unsigned char *data, unsigned char *readback)
+{
+    unsigned int bits = 0, bytes = 0;
+    char columns[VERIFY_COLUMNS_SHOWN * 12 + 8] = "";
+
+    if (!memcmp(data, readback, geometry.page_size))
+    {
+        return 0;
+    }
+
+    for (unsigned int column = 0; column < geometry.page_size; column++)
+    {
+        unsigned char diff = data[column] ^ readback[column];
+        if (!diff)
+        {
+            continue;
+        }
+        bits += __builtin_popcount(diff);
+        if (bytes++ < VERIFY_COLUMNS_SHOWN)
+        {
+            size_t len = strlen(columns);
+            snprintf(columns + len, sizeof(columns) - len, " %u", column);
+        }
+    }
+
+    printf("Verify: page %u differs in %u columns (%u bits):%s%s\n", page, bytes, bits,
+           columns, bytes > VERIFY_COLUMNS_SHOWN ? " ..." : "");
+    return bits;
+}
+
+/* Read back and check the pages of the last group programmed */
+int program_stream_verify(prog_params_t *params, program_stream_t *s)
+{
+    unsigned int lo = s->verify_pages, hi = 0;
+
+    s->verify_due = 0;
+
+    /* the pages programmed are the wanted ones outside bad blocks */
+    for (unsigned int i = 0; i < s->verify_pages; i++)
+    {
+        if (program_page_wanted(s->verify_data + i * geometry.page_size)
+            && !bbt_bad(s->bad_blocks, (s->verify_first + i) / geometry.pages_per_block))
+        {
+            lo = i < lo ? i : lo;
+            hi = i + 1;
+        }
+    }
+    if (lo >= hi)
+    {
+        return 0;
+    }
+
+    if (read_pages(params, s->verify_first + lo, hi - lo, s->readback, s->verify_cache))
+    {
+        return -1;
+    }
+
+    for (unsigned int i = lo; i < hi; i++)
+    {
+        unsigned char *data = s->verify_data + i * geometry.page_size;
+        if (!program_page_wanted(data)
+            || bbt_bad(s->bad_blocks, (s->verify_first + i) / geometry.pages_per_block))
+        {
+            continue;
+        }
+
+        unsigned int bits = verify_page(s->verify_first + i, data,
+                                        s->readback + (i - lo) * geometry.page_size);
+        s->verified++;
+        if (bits)
+        {
+            s->verify_failed++;
+            s->verify_bits += bits;
+        }
+    }
+    return 0;
+}
+
+/* Start the next step; 1 when the stream is done, -1 on error */
+int program_stream_start(prog_params_t *params, program_stream_t *s)
+{
+    if (s->verify_due && !s->pending && program_stream_verify(params, s))
+    {
+        return -1;
+    }
+
+    while (s->step_next == s->step_count)
+    {
+        if (!program_stream_read(s))
+        {
+            return 1;
+        }
+    }
+
+    program_step_t *step = &s->steps[s->step_next++];
+
+    /* cache program up to the last step of the group, all in the same block(s) */
+    program_mode_t mode = PROGRAM_PAGE;
+    if (s->cache && s->step_next < s->step_count)
+    {
+        mode = PROGRAM_CACHE;
+    }
+    else if (s->pending_mode == PROGRAM_CACHE)
+    {
+        mode = PROGRAM_CACHE_END;
+    }
+
+    s->programmed += step->count;
+    s->pending = 1;
+    s->pending_step = *step;
+    s->pending_mode = mode;
+    if (program_page_start(params, step, mode))
+    {
+        controlbus_pin_set(params->bus, PIN_nWP, OFF);
+        return -1;
+    }
+
+    if (s->step_next == s->step_count)
+    {
+        /* verified once this last step is done */
+        if (s->verify)
+        {
+            s->verify_due = 1;
+            s->verify_data = s->group_data;
+            s->verify_first = s->group_first;
+            s->verify_pages = s->group_pages;
+        }
+        /* while the chip programs the group's last step */
+        program_stream_read(s);
+    }
+    return 0;
+}
+
+/* Wait for the step in flight and check it */
+int program_stream_finish(prog_params_t *params, program_stream_t *s)
+{
+    if (!s->pending)
+    {
+        return 0;
+    }
+
+    s->pending = 0;
+    if (program_page_finish(params, &s->pending_step, s->pending_mode) != 0)
+    {
+        program_stream_error(params, s);
+        return -1;
+    }
+    return 0;
+}
+
+int program_die_start(prog_params_t *params, void *ctx, unsigned int *page)
+{
+    program_stream_t *s = ctx;
+    int ret = program_stream_start(params, s);
+
+    *page = s->pending_step.page[0];
+    return ret;
+}
+
+int program_die_check(prog_params_t *params, void *ctx, unsigned char status)
+{
+    program_stream_t *s = ctx;
+
+    s->pending = 0;
+    if (program_page_check(&s->pending_step, s->pending_mode, status))
+    {
+        program_stream_error(params, s);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Program params->count pages of the given file (params->input_file) 
+ * into the flash starting at page params->start_page. With several dies,
+ * each one's part of the range is a stream of its own, see run_dies().
+ */
+int program_file(prog_params_t *params)
+{
+    if (params->input_file == NULL)
+    {
+        fprintf(stderr, "error: no input_file specified\n");
+        return -1;
+    }
+
+    if (params->input_skip)
+    {
+        printf("Skipping %d pages from input file (%ld bytes)\n", 
+               params->input_skip, (long)params->input_skip * geometry.page_size);
+    }
+
+    int count = params->count;
+    if (count == 0)
+    {
+        count = params->dies * geometry.page_count - params->start_page;
+    }
+    else if (params->logical)
+    {
+        count = bbt_physical_count(params, params->start_page, count);
+    }
+
+    program_stream_t streams[DIE_MAX];
+    die_stream_t dies[DIE_MAX];
+    memset(dies, 0, sizeof(dies));
+    for (int d = 0; d < params->dies; d++)
+    {
+        unsigned int first;
+        unsigned int pages = die_range(d, geometry.page_count, params->start_page, count, &first);
+
+        if (program_stream_open(params, &streams[d], first, pages))
+        {
+            while (d--)
+            {
+                program_stream_close(&streams[d]);
+            }
+            return -1;
+        }
+        dies[d].start = program_die_start;
+        dies[d].check = program_die_check;
+        dies[d].ctx = &streams[d];
+        dies[d].active = pages > 0;
+    }
+
+    bbt_report(params, params->start_page, count);
+    if (params->logical)
+    {
+        printf("Logical image: its blocks go to the good blocks in turn\n");
+    }
+    if (streams[0].cache)
+    {
+        printf("Using cache programming\n");
+    }
+    if (streams[0].multi_plane)
+    {
+        printf("Using multi-plane programming\n");
+    }
+
+    usb_stats_t stats_start = bus_stats(params->bus);
+    int ret = 0;
+    if (params->dies > 1)
+    {
+        ret = run_dies(params, dies);
+    }
+    else
+    {
+        int r;
+        while ((r = program_stream_start(params, &streams[0])) == 0
+               && !(ret = program_stream_finish(params, &streams[0])))
+            ;
+        if (r < 0)
+        {
+            ret = -1;
+        }
+    }
+
+    int n = 0;
+    int programmed = 0, skipped = 0, bad = 0;
+    int verified = 0, verify_failed = 0;
+    unsigned long verify_bits = 0;
+    for (int d = 0; d < params->dies; d++)
+    {
+        n += streams[d].n;
+        programmed += streams[d].programmed;
+        skipped += streams[d].skipped;
+        bad += streams[d].bad;
+        verified += streams[d].verified;
+        verify_failed += streams[d].verify_failed;
+        verify_bits += streams[d].verify_bits;
+        program_stream_close(&streams[d]);
+    }
+    if (ret)
+    {
+        return -1;
+    }
+
+    printf("Went over %d pages, programmed %d pages, empty skipped %d, bad block skipped %d\n",
+           n, programmed, skipped, bad);
+    print_usb_stats(params->bus, &stats_start, programmed);
+    if (params->verify)
+    {
+        printf("Verify: %d pages read back, %d differ (%lu bits)\n",
+               verified, verify_failed, verify_bits);
+        return verify_failed ? -1 : 0;
     }
 
-    // Finished reading the data
-    printf("Closing binary dump file...\n");
-    fclose(fp);
+    return 0;
+}
+
+/*
+ * Erase stream: the blocks of a range, a plane group at a time when the
+ * chip does multi-plane erases. With -z, blocks that read back all 0xFF,
+ * spare areas included, are left alone.
+ */
+typedef struct _erase_stream {
+    unsigned int block;
+    unsigned int end_block;
+    unsigned int blocks;        /* of the erase in flight */
+    int multi_plane;
+    const unsigned char *bad_blocks; /* skipped, see bbt_bad() */
+    unsigned char *buf;         /* a block of pages, for -z; NULL: no blank check */
+    int cache;                  /* blank check with cache reads */
+    unsigned int checked_block; /* last block checked, and whether it's blank */
+    int checked_blank;
+    int done;                   /* blocks erased so far, for progress */
+    int count;
+    int blank;                  /* blocks found erased already */
+} erase_stream_t;
+
+/*
+ * Blank check (-z): 1 if every page of the block is erased, 0 if not, -1 on
+ * error. Blocks are programmed from their first page up, so that page alone
+ * tells most used blocks; the others are then read in one go, with cache
+ * reads where the chip has them, and checked once they're all in.
+ */
+int erase_block_blank(prog_params_t *params, erase_stream_t *s, unsigned int block)
+{
+    unsigned int page = block * geometry.pages_per_block;
+    unsigned int rest = geometry.pages_per_block - 1;
+
+    if (s->checked_block == block)
+    {
+        return s->checked_blank;
+    }
+
+    if (read_pages(params, page, 1, s->buf, 0))
+    {
+        return -1;
+    }
+    s->checked_block = block;
+    s->checked_blank = is_all_val(s->buf, geometry.page_size, 0xFF);
+    if (!s->checked_blank || rest == 0)
+    {
+        return s->checked_blank;
+    }
+
+    if (read_pages(params, page + 1, rest, s->buf, s->cache))
+    {
+        return -1;
+    }
+    s->checked_blank = is_all_val(s->buf, rest * geometry.page_size, 0xFF);
+    return s->checked_blank;
+}
+
+/* Pick the next block(s) to erase; 0 when there are none left, -1 on error */
+int erase_stream_next(prog_params_t *params, erase_stream_t *s)
+{
+    for (;;)
+    {
+        while (s->block < s->end_block && bbt_bad(s->bad_blocks, s->block))
+        {
+            s->done++;
+            printf("Skipping bad block %u (%d/%d)\n", s->block, s->done, s->count);
+            s->block++;
+        }
+        if (s->block >= s->end_block)
+        {
+            return 0;
+        }
+        if (!s->buf)
+        {
+            break;
+        }
+
+        int blank = erase_block_blank(params, s, s->block);
+        if (blank < 0)
+        {
+            return -1;
+        }
+        else if (!blank)
+        {
+            break;
+        }
+        s->done++;
+        s->blank++;
+        printf("Block %u is erased already, skipped (%d/%d)\n", s->block, s->done, s->count);
+        s->block++;
+    }
+
+    /* whole plane groups without a bad or blank block are erased together,
+     * the rest one by one */
+    s->blocks = 1;
+    if (s->multi_plane && s->block % geometry.planes == 0 && s->end_block - s->block >= geometry.planes)
+    {
+        s->blocks = geometry.planes;
+        for (unsigned int b = 1; b < geometry.planes; b++)
+        {
+            if (bbt_bad(s->bad_blocks, s->block + b))
+            {
+                s->blocks = 1;
+            }
+            else if (s->buf)
+            {
+                int blank = erase_block_blank(params, s, s->block + b);
+                if (blank < 0)
+                {
+                    return -1;
+                }
+                if (blank)
+                {
+                    s->blocks = 1;
+                }
+            }
+        }
+    }
+
+    s->done += s->blocks;
+    printf("Erasing block %u%s (%d/%d, %.1f%%)\n", s->block, s->blocks > 1 ? " and up" : "",
+           s->done, s->count, (s->done * 100.0) / s->count);
+    return s->blocks;
+}
 
+int erase_die_start(prog_params_t *params, void *ctx, unsigned int *page)
+{
+    erase_stream_t *s = ctx;
+
+    int r = erase_stream_next(params, s);
+    if (r <= 0)
+    {
+        return r < 0 ? -1 : 1;
+    }
+    *page = s->block * geometry.pages_per_block;
+    return erase_blocks_start(params, s->block, s->blocks) ? -1 : 0;
+}
+
+int erase_die_check(prog_params_t *params, void *ctx, unsigned char status)
+{
+    erase_stream_t *s = ctx;
+
+    if (erase_blocks_check(s->block, s->blocks, status))
+    {
+        return -1;
+    }
+    s->block += s->blocks;
     return 0;
 }
 
-/**
- * BlockErase
- *
- * "The Erase operation is done on a block basis.
- * Block address loading is accomplished in three cycles initiated by an Erase Setup command (60h).
- * Only address A18 to A29 is valid while A12 to A17 is ignored (x8).
- *
- * The Erase Confirm command (D0h) following the block address loading initiates the internal erasing process.
- * This two step sequence of setup followed by execution command ensures that memory contents are not
- * accidentally erased due to external noise conditions.
+/*
+ * Erase params->count blocks, starting at block params->start_block.
+ */
+int erase_flash(prog_params_t *params)
+{
+    int count = params->count; /* BLOCK count in this case */
+    if (count == 0)
+    {
+        count = params->dies * geometry.block_count - params->start_block;
+    }
+
+    erase_stream_t streams[DIE_MAX];
+    die_stream_t dies[DIE_MAX];
+    memset(dies, 0, sizeof(dies));
+    for (int d = 0; d < params->dies; d++)
+    {
+        unsigned int first;
+        unsigned int blocks = die_range(d, geometry.block_count, params->start_block, count, &first);
+
+        memset(&streams[d], 0, sizeof(streams[d]));
+        streams[d].block = first;
+        streams[d].end_block = first + blocks;
+        streams[d].count = blocks;
+        streams[d].multi_plane = (params->features & CHIP_MULTI_PLANE) && !params->basic_commands;
+        streams[d].bad_blocks = params->bad_blocks;
+        streams[d].checked_block = UINT_MAX;
+        streams[d].cache = (params->features & CHIP_CACHE_READ) && !params->basic_commands;
+        if (params->blank_check
+            && (streams[d].buf = malloc(geometry.pages_per_block * geometry.page_size)) == NULL)
+        {
+            fprintf(stderr, "malloc error, size=%d\n", geometry.pages_per_block * geometry.page_size);
+            while (d--)
+            {
+                free(streams[d].buf);
+            }
+            return -1;
+        }
+        dies[d].start = erase_die_start;
+        dies[d].check = erase_die_check;
+        dies[d].ctx = &streams[d];
+        dies[d].active = blocks > 0;
+    }
+
+    usb_stats_t stats_start = bus_stats(params->bus);
+    int ret = 0;
+    if (params->dies > 1)
+    {
+        ret = run_dies(params, dies);
+    }
+    else
+    {
+        erase_stream_t *s = &streams[0];
+        int r;
+        while ((r = erase_stream_next(params, s)) > 0)
+        {
+            if (erase_blocks(params, s->block, s->blocks)) 
+            {
+                break;
+            }
+            s->block += s->blocks;
+        }
+        ret = r ? -1 : 0;
+    }
+
+    int blank = 0;
+    for (int d = 0; d < params->dies; d++)
+    {
+        blank += streams[d].blank;
+        free(streams[d].buf);
+    }
+    if (ret)
+    {
+        return -1;
+    }
+
+    if (params->blank_check)
+    {
+        printf("Blank check: %d of %d blocks were erased already, not erased again\n",
+               blank, count);
+    }
+    print_usb_stats(params->bus, &stats_start, count * geometry.pages_per_block);
+    return 0;
+}
+
+/*
+ * Sync (-y image): bring a chip that already holds an older version of the
+ * image in line with it, a block at a time. Each block is read back and
+ * compared with the image; only the blocks that differ are erased and
+ * programmed again. Image pages that programming skips (see
+ * program_page_wanted()) are expected erased on the chip, which is_all_val()
+ * tells without comparing them byte by byte. As with -z, the first page of
+ * a block is read alone first, the others with cache reads only if it
+ * matches. Past the end of the image, the chip is left alone; within its
+ * last block, the missing pages are expected erased.
+ */
+int sync_page_differs(unsigned char *chip, unsigned char *image)
+{
+    if (!program_page_wanted(image))
+    {
+        return !is_all_val(chip, geometry.page_size, 0xFF);
+    }
+    return memcmp(chip, image, geometry.page_size) != 0;
+}
+
+/* 1 if the block differs from the image, 0 if it matches, -1 on error */
+int sync_block_differs(prog_params_t *params, unsigned int block, unsigned char *image,
+                       unsigned char *chip)
+{
+    unsigned int page = block * geometry.pages_per_block;
+    int cache = (params->features & CHIP_CACHE_READ) && !params->basic_commands;
+
+    if (read_pages(params, page, 1, chip, 0))
+    {
+        return -1;
+    }
+    if (sync_page_differs(chip, image))
+    {
+        return 1;
+    }
+
+    if (read_pages(params, page + 1, geometry.pages_per_block - 1, chip, cache))
+    {
+        return -1;
+    }
+    for (unsigned int i = 1; i < geometry.pages_per_block; i++)
+    {
+        if (sync_page_differs(chip + (i - 1) * geometry.page_size,
+                              image + i * geometry.page_size))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Erase the block and program its pages from the input file again; with
+ * -V, the pages that don't read back right are added to verify_failed
+ */
+int sync_block_rewrite(prog_params_t *params, unsigned int block, unsigned int *verify_failed)
+{
+    program_stream_t s;
+    int r, ret = 0;
+
+    if (erase_blocks(params, block, 1))
+    {
+        return -1;
+    }
+    if (program_stream_open(params, &s, block * geometry.pages_per_block,
+                            geometry.pages_per_block))
+    {
+        return -1;
+    }
+    while ((r = program_stream_start(params, &s)) == 0
+           && !(ret = program_stream_finish(params, &s)))
+        ;
+    *verify_failed += s.verify_failed;
+    program_stream_close(&s);
+    return r < 0 || ret ? -1 : 0;
+}
+
+int sync_file(prog_params_t *params)
+{
+    unsigned int block_size = geometry.pages_per_block * geometry.page_size;
+    unsigned int count = params->count;
+    unsigned int same = 0, rewritten = 0, bad = 0, verify_failed = 0;
+    unsigned char *image, *chip;
+    FILE *f;
+    int ret = 0;
+
+    if (params->start_page % geometry.pages_per_block || count % geometry.pages_per_block)
+    {
+        fprintf(stderr, "-y (sync) works on whole blocks: -s and -c must be multiples "
+                        "of %u pages\n", geometry.pages_per_block);
+        return -1;
+    }
+    if (count == 0)
+    {
+        count = params->dies * geometry.page_count - params->start_page;
+    }
+
+    if ((f = fopen(params->input_file, "rb")) == NULL)
+    {
+        fprintf(stderr, "Error: can't open input data file: %s\n", params->input_file);
+        return -1;
+    }
+    if (params->input_skip && fseek(f, (long)params->input_skip * geometry.page_size, SEEK_SET))
+    {
+        fprintf(stderr, "Seek failed, aborting\n");
+        fclose(f);
+        return -1;
+    }
+
+    image = malloc(block_size);
+    chip = malloc(block_size);
+    if (image == NULL || chip == NULL)
+    {
+        fprintf(stderr, "malloc error, size=%u\n", block_size);
+        free(image);
+        free(chip);
+        fclose(f);
+        return -1;
+    }
+
+    usb_stats_t stats_start = bus_stats(params->bus);
+    unsigned int first_block = params->start_page / geometry.pages_per_block;
+    unsigned int end_block = first_block + count / geometry.pages_per_block;
+    struct stat st;
+
+    if (!fstat(fileno(f), &st))
+    {
+        /* blocks the image covers, for progress */
+        unsigned long image_pages = st.st_size / geometry.page_size;
+        image_pages = image_pages > (unsigned long)params->input_skip
+                    ? image_pages - params->input_skip : 0;
+        unsigned long image_blocks = (image_pages + geometry.pages_per_block - 1)
+                                     / geometry.pages_per_block;
+        if (image_blocks < end_block - first_block)
+            end_block = first_block + image_blocks;
+    }
+
+    for (unsigned int block = first_block; block < end_block; block++)
+    {
+        unsigned int got = fread(image, geometry.page_size, geometry.pages_per_block, f);
+        if (got == 0)
+        {
+            /* end of the image */
+            break;
+        }
+        memset(image + got * geometry.page_size, 0xFF, block_size - got * geometry.page_size);
+
+        if (bbt_bad(params->bad_blocks, block))
+        {
+            printf("Skipping bad block %u\n", block);
+            bad++;
+            continue;
+        }
+
+        die_select(params->bus, block / geometry.block_count);
+        controlbus_update_output(params->bus);
+        int r = sync_block_differs(params, block, image, chip);
+        if (r < 0)
+        {
+            ret = -1;
+            break;
+        }
+        else if (r == 0)
+        {
+            same++;
+            continue;
+        }
+
+        printf("Block %u differs, erasing and programming it again (%u/%u)\n",
+               block, block - first_block + 1, end_block - first_block);
+        if (sync_block_rewrite(params, block, &verify_failed))
+        {
+            ret = -1;
+            break;
+        }
+        rewritten++;
+    }
+
+    die_select(params->bus, 0);
+    controlbus_update_output(params->bus);
+    free(image);
+    free(chip);
+    fclose(f);
+    if (ret)
+    {
+        return -1;
+    }
+
+    printf("Sync: %u blocks already matched, %u erased and programmed again, %u bad skipped\n",
+           same, rewritten, bad);
+    print_usb_stats(params->bus, &stats_start, (same + rewritten) * geometry.pages_per_block);
+    if (params->verify)
+    {
+        printf("Verify: %u pages programmed again differ\n", verify_failed);
+        return verify_failed ? -1 : 0;
+    }
+    return 0;
+}
+
+/*
+ * Copy-back (-m src:dst[:count]).
  *
- * At the rising edge of WE after the erase confirm command input,
- * the internal write controller handles erase and erase verify.
+ * Moves blocks inside the chip: each page is read into the page register
+ * with 00h-35h and programmed to its new place with 85h-10h, so its data
+ * never crosses USB. Patches (-P) change a few columns on the way, with
+ * random data input (85h and a column address) before the program confirm.
+ * The chip doesn't check the ECC on the way, bit errors of the source page
+ * are copied as they are. Source and destination must be in the same plane
+ * and die, and the destination must be erased.
  *
- * Once the erase process starts, the Read Status Register command may be entered to read the status register.
- * The system controller can detect the completion of an erase by monitoring the R/B output,
- * or the Status bit (I/O 6) of the Status Register.
- * Only the Read Status command and Reset command are valid while erasing is in progress.
- * When the erase operation is completed, the Write Status Bit (I/O 0) may be checked."
+ * Patch file lines: <destination page> <column> <hex bytes>, '#' starts a
+ * comment.
  */
-int erase_block(prog_params_t *params, unsigned int block)
+#define PATCH_LINE_MAX (2 * PAGE_SIZE_MAX + 64)
+
+typedef struct _move_patch {
+    unsigned int page;
+    unsigned int column;
+    unsigned int length;
+    unsigned char *data;
+} move_patch_t;
+
+void free_patches(move_patch_t *patches, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        free(patches[i].data);
+    }
+    free(patches);
+}
+
+/* Read the patch file; returns the number of patches, -1 on error */
+int load_patches(const char *path, move_patch_t **patches)
+{
+    FILE *f = fopen(path, "r");
+    char *line = malloc(PATCH_LINE_MAX);
+    int count = 0, line_no = 0;
+
+    *patches = NULL;
+    if (f == NULL || line == NULL)
+    {
+        fprintf(stderr, "Error: can't open patch file: %s\n", path);
+        free(line);
+        if (f)
+            fclose(f);
+        return -1;
+    }
+
+    while (fgets(line, PATCH_LINE_MAX, f))
+    {
+        unsigned int page, column;
+        char hex[PATCH_LINE_MAX];
+        char *comment = strchr(line, '#');
+
+        line_no++;
+        if (comment)
+        {
+            *comment = '\0';
+        }
+        int fields = sscanf(line, "%u %u %s", &page, &column, hex);
+        if (fields <= 0)
+        {
+            continue;
+        }
+
+        unsigned int length = strlen(hex) / 2;
+        if (fields != 3 || strlen(hex) % 2 || column + length > geometry.page_size)
+        {
+            fprintf(stderr, "%s:%d: expected <page> <column> <hex bytes> within the page\n",
+                    path, line_no);
+            goto fail;
+        }
+
+        move_patch_t *grown = realloc(*patches, (count + 1) * sizeof(**patches));
+        if (grown == NULL)
+        {
+            fprintf(stderr, "malloc error, size=%zu\n", (count + 1) * sizeof(**patches));
+            goto fail;
+        }
+        *patches = grown;
+
+        move_patch_t *patch = &(*patches)[count];
+        patch->page = page;
+        patch->column = column;
+        patch->length = length;
+        if ((patch->data = malloc(length)) == NULL)
+        {
+            fprintf(stderr, "malloc error, size=%u\n", length);
+            goto fail;
+        }
+        count++;
+
+        for (unsigned int k = 0; k < length; k++)
+        {
+            if (sscanf(hex + 2 * k, "%2hhx", &patch->data[k]) != 1)
+            {
+                fprintf(stderr, "%s:%d: bad hex byte at %u\n", path, line_no, k);
+                goto fail;
+            }
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return count;
+
+fail:
+    free_patches(*patches, count);
+    *patches = NULL;
+    free(line);
+    fclose(f);
+    return -1;
+}
+
+int copy_back_page(prog_params_t *params, unsigned int src, unsigned int dst,
+                   move_patch_t *patches, int patch_count)
 {
-    uint32_t mem_address;
-    unsigned int page;
     unsigned char addr_cycles[5];
 
-    /* calculate memory address */
-    page = block * PAGE_PER_BLOCK;
-    mem_address = PAGE_SIZE_NOSPARE * page; 
+    DBG("Latching copy-back read of page %u...\n", src);
+    latch_command(params, CMD_READCOPYBACK[0]);
+    get_address_cycle_map_x8_toshiba_page(src, 0, addr_cycles);
+    latch_address(params, addr_cycles, ADDRESS_CYCLES);
+    latch_command(params, CMD_READCOPYBACK[1]);
+    if (wait_while_busy(params, WAIT_READ))
+    {
+        return 1;
+    }
 
     /* remove write protection */
-    controlbus_pin_set(PIN_nWP, ON);
+    controlbus_pin_set(params->bus, PIN_nWP, ON);
 
-    DBG("Latching first command byte to erase a block...\n");
-    latch_command(params, CMD_BLOCKERASE[0]); /* block erase setup command */
+    DBG("Latching copy-back program to page %u...\n", dst);
+    latch_command(params, CMD_COPYBACKPROGRAM[0]);
+    get_address_cycle_map_x8_toshiba_page(dst, 0, addr_cycles);
+    latch_address(params, addr_cycles, ADDRESS_CYCLES);
 
-    DBG("Erasing block %u at memory address 0x%08X (page %u)\n", block, mem_address, page);
-    get_address_cycle_map_x8_toshiba_page(page, 0, addr_cycles);
-    DBG("  Address cycles are (but: will take only cycles 3..5) : 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
-        addr_cycles[0], addr_cycles[1], /* column address */
-        addr_cycles[2], addr_cycles[3], addr_cycles[4] ); /* row address */
-
-    DBG("Latching page(row) address (3 bytes)...\n");
-    unsigned char address[] = { addr_cycles[2], addr_cycles[3], addr_cycles[4] };
-    latch_address(params, address, 3);
-
-    DBG("Latching second command byte to erase a block...\n");
-    latch_command(params, CMD_BLOCKERASE[1]);
+    for (int i = 0; i < patch_count; i++)
+    {
+        if (patches[i].page != dst)
+        {
+            continue;
+        }
 
-    /* tWB: WE High to Busy is 100 ns -> ignore it here as it takes some time for the next command to execute */
+        printf("  patching %u bytes at column %u\n", patches[i].length, patches[i].column);
+        latch_command(params, CMD_CHANGEWRITECOLUMN);
+        get_address_cycle_map_x8_toshiba_page(dst, patches[i].column, addr_cycles);
+        latch_address(params, addr_cycles, geometry.column_cycles); /* column address */
+        latch_data_out(params, patches[i].data, patches[i].length);
+    }
 
-    // busy-wait for high level at the busy line
-    wait_while_busy();
+    latch_command(params, CMD_COPYBACKPROGRAM[1]);
+    if (wait_while_busy(params, WAIT_PROGRAM))
+    {
+        controlbus_pin_set(params->bus, PIN_nWP, OFF);
+        return 1;
+    }
 
     /* Read status */
-    DBG("Latching command byte to read status...\n");
     latch_command(params, CMD_READSTATUS);
-
     unsigned char status_register;
     latch_register(params, &status_register, 1); /* data output operation */
-    DBG("Status register content:   0x%02X\n", status_register);
 
     /* activate write protection again */
-    controlbus_pin_set(PIN_nWP, OFF);
+    controlbus_pin_set(params->bus, PIN_nWP, OFF);
 
     if (status_register & STATUSREG_IO0)
     {
-        fprintf(stderr, "Failed to erase block %u, status register=%02X.\n", block, status_register);
+        fprintf(stderr, "Failed to copy page %u to page %u, status register=%02X.\n",
+                src, dst, status_register);
         return 1;
     }
-
-    printf("  Successfully erased block %u.\n", block);
     return 0;
 }
 
-int latch_data_out(prog_params_t *params, unsigned char data[], unsigned int length)
+int move_blocks(prog_params_t *params)
 {
-    for (unsigned int k = 0; k < length; k++)
+    unsigned int src = params->move_src;
+    unsigned int dst = params->move_dst;
+    unsigned int count = params->move_count;
+    unsigned int blocks = params->dies * geometry.block_count;
+    move_patch_t *patches = NULL;
+    int patch_count = 0;
+
+    if (!(params->features & CHIP_COPY_BACK))
     {
-        // toggle nWE low
-        controlbus_pin_set(PIN_nWE, OFF);
-        controlbus_update_output();
-        _usleep(params->delay);
+        fprintf(stderr, "This chip has no copy-back, dump and program the blocks instead\n");
+        return -1;
+    }
+    if (count == 0 || src + count > blocks || dst + count > blocks)
+    {
+        fprintf(stderr, "Blocks %u-%u to %u-%u are out of the chip (%u blocks)\n",
+                src, src + count - 1, dst, dst + count - 1, blocks);
+        return -1;
+    }
+    if (src < dst + count && dst < src + count)
+    {
+        fprintf(stderr, "The source and destination blocks overlap\n");
+        return -1;
+    }
+    if (src % geometry.planes != dst % geometry.planes)
+    {
+        fprintf(stderr, "Copy-back stays within a plane: blocks %u and %u are in "
+                        "different planes\n", src, dst);
+        return -1;
+    }
+    if (src / geometry.block_count != (src + count - 1) / geometry.block_count
+        || dst / geometry.block_count != src / geometry.block_count
+        || (dst + count - 1) / geometry.block_count != src / geometry.block_count)
+    {
+        fprintf(stderr, "Copy-back stays within a die: blocks %u-%u and %u-%u are not "
+                        "all on the same one\n", src, src + count - 1, dst, dst + count - 1);
+        return -1;
+    }
+    for (unsigned int b = 0; b < count; b++)
+    {
+        if (bbt_bad(params->bad_blocks, src + b) || bbt_bad(params->bad_blocks, dst + b))
+        {
+            fprintf(stderr, "Block %u is bad, not moving blocks %u-%u to %u-%u\n",
+                    bbt_bad(params->bad_blocks, src + b) ? src + b : dst + b,
+                    src, src + count - 1, dst, dst + count - 1);
+            return -1;
+        }
+    }
 
-        // change I/O pins
-        iobus_set_value(data[k]);
-        iobus_update_output();
-        _usleep(params->delay); /* TODO: assure setup delay */
+    if (params->patch_file)
+    {
+        if ((patch_count = load_patches(params->patch_file, &patches)) < 0)
+        {
+            return -1;
+        }
+        printf("Loaded %d patches from %s\n", patch_count, params->patch_file);
+    }
 
-        // toggle nWE back high (acts as clock to latch the current address byte!)
-        controlbus_pin_set(PIN_nWE, ON);
-        controlbus_update_output();
-        _usleep(params->delay); /* TODO: assure hold delay */
+    die_select(params->bus, src / geometry.block_count);
+    controlbus_update_output(params->bus);
+
+    usb_stats_t stats_start = bus_stats(params->bus);
+    unsigned int pages = count * geometry.pages_per_block;
+    for (unsigned int i = 0; i < pages; i++)
+    {
+        unsigned int src_page = src * geometry.pages_per_block + i;
+        unsigned int dst_page = dst * geometry.pages_per_block + i;
+
+        printf("Copying page %u to page %u (%u/%u, %.1f%%)\n", src_page, dst_page,
+               i + 1, pages, (i + 1) * 100.0 / pages);
+        if (copy_back_page(params, src_page, dst_page, patches, patch_count))
+        {
+            free_patches(patches, patch_count);
+            return -1;
+        }
     }
 
+    free_patches(patches, patch_count);
+    printf("Moved blocks %u-%u to %u-%u\n", src, src + count - 1, dst, dst + count - 1);
+    print_usb_stats(params->bus, &stats_start, pages);
     return 0;
 }
 
-/**
- * Page Program
- *
- * "The device is programmed by page.
- * The number of consecutive partial page programming operation within the same page
- * without an intervening erase operation must not exceed 8 times.
- *
- * The addressing should be done on each pages in a block.
- * A page program cycle consists of a serial data loading period in which up to 2112 bytes of data
- * may be loaded into the data register, followed by a non-volatile programming period where the loaded data
- * is programmed into the appropriate cell.
- *
- * The serial data loading period begins by inputting the Serial Data Input command (80h),
- * followed by the five cycle address inputs and then serial data.
- *
- * The bytes other than those to be programmed do not need to be loaded.
- *
- * The device supports random data input in a page.
- * The column address of next data, which will be entered, may be changed to the address which follows
- * random data input command (85h).
- * Random data input may be operated multiple times regardless of how many times it is done in a page.
- *
- * The Page Program confirm command (10h) initiates the programming process.
- * Writing 10h alone without pre-viously entering the serial data will not initiate the programming process.
- * The internal write state controller automatically executes the algorithms and timings necessary for
- * program and verify, thereby freeing the system controller for other tasks.
- * Once the program process starts, the Read Status Register command may be entered to read the status register.
- * The system controller can detect the completion of a program cycle by monitoring the R/B output,
- * or the Status bit (I/O 6) of the Status Register.
- * Only the Read Status command and Reset command are valid while programming is in progress.
- *
- * When the Page Program is complete, the Write Status Bit (I/O 0) may be checked.
- * The internal write verify detects only errors for "1"s that are not successfully programmed to "0"s.
+/*
+ * Link calibration (-C).
  *
- * The command register remains in Read Status command mode until another valid command is written to the
- * command register.
+ * Starting from the defaults, each link setting is swept in turn, keeping
+ * the others at the best values found so far: the bit-bang sample rate
+ * (bitbang engine only), the latency timer and the USB chunk size. Each
+ * candidate reopens the link, then reads the ID and the reference page
+ * (-s) CALIBRATE_REPEATS times; any read that differs from what the
+ * defaults read makes the candidate unstable. The fastest stable settings
+ * are saved as the device's link profile. Settings given on the command
+ * line are kept as they are.
  */
-int program_page(prog_params_t *params, unsigned int page, unsigned char* data)
-{
-    uint32_t mem_address;
-    unsigned char addr_cycles[5];
-
-    mem_address = page* PAGE_SIZE_NOSPARE;
-    printf("Writing data to page %u, memory address 0x%02X\n", page, mem_address);
+#define CALIBRATE_REPEATS 4
+#define CALIBRATE_MARGIN_PERCENT 3 /* a candidate must be that much faster to win */
 
-    /* remove write protection */
-    controlbus_pin_set(PIN_nWP, ON);
+static const int calibrate_rates[] = { 500000, 1000000, 2000000, 4000000, 8000000, 0 };
+static const int calibrate_latencies[] = { 1, 2, 4, 8, 16, 0 };
+static const int calibrate_chunks[] = { 512, 1024, 4096, 16384, 65536, 0 };
 
-    get_address_cycle_map_x8_toshiba_page(page, 0, addr_cycles);
-    DBG("  Address cycles are: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
-        addr_cycles[0], addr_cycles[1], /* column address */
-        addr_cycles[2], addr_cycles[3], addr_cycles[4]); /* row address */
+nand_bus_t *calibrate_open(prog_params_t *params)
+{
+    nand_bus_t *bus;
 
-    DBG("Latching first command byte to write a page (page size is %d)...\n",
-            PAGE_SIZE);
-    latch_command(params, CMD_PAGEPROGRAM[0]); /* Serial Data Input command */
+    if ((bus = params->bus = bus_open(params)) == NULL)
+    {
+        return NULL;
+    }
 
-    DBG("Latching address cycles...\n");
-    latch_address(params, addr_cycles, 5);
+    controlbus_reset_value(bus);
+    iobus_set_direction(bus, IOBUS_OUT);
+    iobus_reset_value(bus);
+    iobus_update_output(bus);
+
+    controlbus_pin_set(bus, PIN_nRE, ON);
+    controlbus_pin_set(bus, PIN_nWE, ON);
+    die_select(bus, 0);
+    controlbus_pin_set(bus, PIN_nWP, OFF);
+    controlbus_update_output(bus);
+    return bus;
+}
 
-    DBG("Latching out the data of the page...\n");
-    latch_data_out(params, data, PAGE_SIZE);
+void calibrate_close(prog_params_t *params)
+{
+    die_select(params->bus, DIE_NONE);
+    controlbus_update_output(params->bus);
+    bus_close(params->bus);
+    params->bus = NULL;
+}
 
-    DBG("Latching second command byte to write a page...\n");
-    latch_command(params, CMD_PAGEPROGRAM[1]); /* Page Program confirm command command */
+/*
+ * Read the ID and the reference page over and over with the current
+ * settings. Returns the time per page read in usec, or 0 if any read didn't
+ * match the reference.
+ */
+unsigned long long calibrate_trial(prog_params_t *params, unsigned char *ref_id,
+                                   unsigned char *ref_page)
+{
+    unsigned char id[5];
+    unsigned char page[PAGE_SIZE_MAX];
+    unsigned long long elapsed_us = 0;
+    int errors = 0;
 
-    // busy-wait for high level at the busy line
-    wait_while_busy();
+    if (calibrate_open(params) == NULL)
+    {
+        return 0;
+    }
 
-    /* Read status */
-    DBG("Latching command byte to read status...\n");
-    latch_command(params, CMD_READSTATUS);
+    for (int k = 0; k < CALIBRATE_REPEATS; k++)
+    {
+        read_id(params, id);
+        if (memcmp(id, ref_id, sizeof(id)))
+        {
+            errors++;
+        }
 
-    unsigned char status_register;
-    latch_register(params, &status_register, 1); /* data output operation */
+        unsigned long long start_us = bus_now_us(params->bus);
+        if (read_page_start(params, params->start_page, 0))
+        {
+            errors++;
+            break;
+        }
+        latch_register(params, page, geometry.page_size);
+        elapsed_us += bus_now_us(params->bus) - start_us;
 
-    /* output the retrieved status register content */
-    printf("  Status register content:   0x%02X\n", status_register);
+        if (memcmp(page, ref_page, geometry.page_size))
+        {
+            errors++;
+        }
+    }
 
-    /* activate write protection again */
-    controlbus_pin_set(PIN_nWP, OFF);
+    calibrate_close(params);
 
-    if (status_register & STATUSREG_IO0)
+    printf("  sample rate %8d, latency %2d ms, chunk %5d: ", params->sample_rate,
+           params->latency_ms, params->chunk_size);
+    if (errors)
     {
-        fprintf(stderr, "Failed to program page %u.\n", page);
-        return 1;
+        printf("UNSTABLE (%d bad reads)\n", errors);
+        return 0;
     }
-
-    printf("  => Successfully programmed page %u.\n", page);
-    return 0;
+    elapsed_us = elapsed_us / CALIBRATE_REPEATS + 1;
+    printf("%llu us per page (%.1f KiB/s)\n", elapsed_us,
+           geometry.page_size * 1e6 / 1024 / elapsed_us);
+    return elapsed_us;
 }
 
-/*
- * Return 1 if the given buffer is all the same value, 0 if at least one byte
- * is different.
- */
-int is_all_val(unsigned char *b, int len, unsigned char val)
+/* Try each value of one setting, keep the fastest stable one */
+void calibrate_sweep(prog_params_t *params, int *setting, const int *values,
+                     unsigned char *ref_id, unsigned char *ref_page,
+                     unsigned long long *best_us)
 {
-    unsigned char *p = b;
-    for (int i = 0; i < len; i++, p++) 
+    int best = *setting;
+
+    for (int i = 0; values[i]; i++)
     {
-        if (*p != val) 
+        if (values[i] == best)
         {
-            return 0;
+            continue;
         }
-    }
 
-    return 1;
+        *setting = values[i];
+        unsigned long long us = calibrate_trial(params, ref_id, ref_page);
+        if (us && us * (100 + CALIBRATE_MARGIN_PERCENT) < *best_us * 100)
+        {
+            *best_us = us;
+            best = values[i];
+        }
+    }
+    *setting = best;
 }
 
-/*
- * Program params->count pages of the given file (params->input_file) 
- * into the flash starting at page params->start_page.
- */
-int program_file(prog_params_t *params)
+int calibrate_link(prog_params_t *params)
 {
-    if (params->input_file == NULL)
+    unsigned char ref_id[5];
+    unsigned char ref_page[PAGE_SIZE_MAX];
+    int fixed_rate = params->sample_rate;
+    int fixed_latency = params->latency_ms;
+    int fixed_chunk = params->chunk_size;
+    unsigned long long best_us;
+    char serial[LINK_SERIAL_MAX];
+
+    /* the reference reads, at the defaults (or what was asked for) */
+    params->sample_rate = fixed_rate ? fixed_rate : DEFAULT_SAMPLE_RATE;
+    params->latency_ms = fixed_latency ? fixed_latency : DEFAULT_LATENCY_MS;
+    params->chunk_size = fixed_chunk ? fixed_chunk : calibrate_chunks[2];
+
+    printf("Calibrating the %s link on page %d...\n", params->engine, params->start_page);
+    if (calibrate_open(params) == NULL)
     {
-        fprintf(stderr, "error: no input_file specified\n");
         return -1;
     }
-
-    FILE *f = fopen(params->input_file, "rb");
-    if (f == NULL)
+    if (!params->bus->ops->serial || params->bus->ops->serial(params->bus) == NULL)
     {
-        fprintf(stderr, "Error: can't open input data file: %s\n", params->input_file);
+        fprintf(stderr, "The %s engine has no device serial number to keep a link "
+                        "profile for\n", params->bus->ops->name);
+        calibrate_close(params);
         return -1;
     }
+    snprintf(serial, sizeof(serial), "%s", params->bus->ops->serial(params->bus));
 
-    unsigned char *buf = malloc(PAGE_SIZE);
-    if (buf == NULL) 
+    read_id(params, ref_id);
+    if (chip_identify(params, ref_id))
     {
-        fprintf(stderr, "malloc error, size=%d\n", PAGE_SIZE);
-        fclose(f);
+        calibrate_close(params);
         return -1;
     }
-
-    if (params->input_skip)
+    if (read_page_start(params, params->start_page, 0))
     {
-        long skip_bytes = params->input_skip * PAGE_SIZE;
-        printf("Skipping %d pages from input file (%ld bytes)\n", 
-               params->input_skip, skip_bytes);
-        fseek(f, skip_bytes, SEEK_SET);
-        if (ftell(f) != skip_bytes)
-        {
-            fprintf(stderr, "Seek failed, aborting\n");
-            free(buf);
-            fclose(f);
-            return -1;
-        }
+        calibrate_close(params);
+        return -1;
     }
+    latch_register(params, ref_page, geometry.page_size);
+    calibrate_close(params);
 
-    int count = params->count;
-    if (count == 0)
+    if ((best_us = calibrate_trial(params, ref_id, ref_page)) == 0)
     {
-        count = DEFAULT_PAGE_COUNT - params->start_page;
+        fprintf(stderr, "Reads aren't stable even with the default link settings, "
+                        "check the wiring\n");
+        return -1;
     }
 
-    int n = 0;
-    int programmed = 0, skipped = 0;
-    unsigned int page_idx = params->start_page;
-    while (n < count && fread(buf, PAGE_SIZE, 1, f))
-    {
-        // Skip pages that are purely 0xFFs (NAND only programs bits to 0)
-        // HACK: also skip pages that are purely 0x00s as these might have come 
-        //   from bad blocks, and flashing them would turn possibly good blocks
-        //   into marked-as-bad blocks
-        // TODO: This code will blindly attempt to write over factory bad blocks,
-        //   possibly loosing factory bad block information. 
-        if (!is_all_val(buf, PAGE_SIZE, 0xFF) && !is_all_val(buf, PAGE_SIZE, 0x00))
-        {
-            programmed++;
-            int ret = program_page(params, page_idx, buf);
-            if (ret != 0)
-            {
-                fprintf(stderr, "Program error on page=%d (0x%x), file buf %d; "
-                                "aborting programming\n", 
-                        page_idx, page_idx, n);
-                free(buf);
-                fclose(f);
-                return -1;
-            }
-        }
-        else 
-        {
-            skipped++;
-        }
-        page_idx++;
-        n++;
+    if (!fixed_rate && !strcmp(params->engine, "bitbang"))
+    {
+        calibrate_sweep(params, &params->sample_rate, calibrate_rates,
+                        ref_id, ref_page, &best_us);
     }
-
-    printf("Went over %d pages, programmed %d pages, empty skipped %d\n", n, programmed, skipped);
-
-    free(buf);
-    fclose(f);
-
-    return 0;
-}
-
-/*
- * Erase params->count blocks, starting at block params->start_block.
- */
-int erase_flash(prog_params_t *params)
-{
-    int count = params->count; /* BLOCK count in this case */
-    if (count == 0)
+    if (!fixed_latency)
     {
-        count = BLOCK_COUNT - params->start_block;
+        calibrate_sweep(params, &params->latency_ms, calibrate_latencies,
+                        ref_id, ref_page, &best_us);
     }
-
-    unsigned int block = params->start_block;
-    for (int i = 0; i < count; i++) 
+    if (!fixed_chunk)
     {
-        printf("Erasing block %u (%d/%d, %.1f%%)\n", block, i+1, count, ((i+1) * 100.0) / count);
-        if (erase_block(params, block)) 
-        {
-            return -1;
-        }
-
-        block++;
+        calibrate_sweep(params, &params->chunk_size, calibrate_chunks,
+                        ref_id, ref_page, &best_us);
     }
 
-    return 0;
+    printf("Fastest stable settings: sample rate %d, latency %d ms, chunk %d, "
+           "%.1f KiB/s\n", params->sample_rate, params->latency_ms, params->chunk_size,
+           geometry.page_size * 1e6 / 1024 / best_us);
+    return profile_save(params, serial);
 }
 
 void run_tests(prog_params_t *params)
@@ -1185,51 +6014,36 @@ void run_tests(prog_params_t *params)
            "connected to the rig when this is going on... sleeping 5 seconds, "
            "press CTRL-C NOW if you want to abort...\n");
 
-    _usleep(5* 1000000);
+    bus_usleep(params->bus, 5* 1000000);
 
     printf("testing control bus, check visually...\n");
-    _usleep(2* 1000000);
-    test_controlbus();
+    bus_usleep(params->bus, 2* 1000000);
+    test_controlbus(params->bus);
 
     printf("testing I/O bus for output, check visually...\n");
-    _usleep(2* 1000000);
-    test_iobus();
-}
-
-void close_bus(struct ftdi_context *bus, char *msg)
-{
-    printf("%s", msg);
-    ftdi_disable_bitbang(bus);
-    ftdi_usb_close(bus);
-    ftdi_free(bus);
-}
-
-void close_busses()
-{
-    close_bus(nandflash_iobus, "disabling bitbang mode (channel 1)\n");
-    close_bus(nandflash_controlbus, "disabling bitbang mode (channel 2)\n");
+    bus_usleep(params->bus, 2* 1000000);
+    test_iobus(params->bus);
 }
 
 int main(int argc, char **argv)
 {
     struct ftdi_version_info version;
     unsigned char ID_register[5];
-    int f;
     prog_params_t params;
+    nand_bus_t *bus;
+    wait_engine_t wait;
 
     if (parse_prog_params(&params, argc, argv))
     {
        return 1;
     }
+    wait_engine_init(&wait, &params);
+    params.wait = &wait;
 
     print_prog_params(&params);
-    printf("Current NAND params: page size: %d, page size (w/ OOB): %d, "
-           "pages per block: %d, block count: %d, page count: %d\n",
-           PAGE_SIZE_NOSPARE, PAGE_SIZE, PAGE_PER_BLOCK, BLOCK_COUNT,
-           DEFAULT_PAGE_COUNT);
 
-    if (!params.do_program && !params.do_erase 
-        && !access(params.filename, F_OK) && !params.overwrite)
+    if (!params.do_program && !params.do_erase && !params.calibrate && !params.do_move
+        && !params.do_scan && !params.do_sync && !access(params.filename, F_OK) && !params.overwrite)
     {
         printf("File already exists, use -o to overwrite: %s\n", params.filename);
         return 2;
@@ -1241,122 +6055,155 @@ int main(int argc, char **argv)
         " snapshot ver: %s)\n", version.version_str, version.major,
         version.minor, version.micro, version.snapshot_str);
 
-    // Init 1. channel for databus
-    if ((nandflash_iobus = ftdi_new()) == NULL)
+    if (params.calibrate)
     {
-        fprintf(stderr, "ftdi_new failed for iobus\n");
-        return EXIT_FAILURE;
+        return calibrate_link(&params) ? EXIT_FAILURE : 0;
     }
 
-    ftdi_set_interface(nandflash_iobus, INTERFACE_A);
-    f = ftdi_usb_open(nandflash_iobus, FT2232H_VID, FT2232H_PID);
-    if (f < 0 && f != -5)
+    if ((bus = params.bus = bus_open(&params)) == NULL)
     {
-        fprintf(stderr, "unable to open ftdi device: %d (%s)  --  " \
-                        "Should you run as root?\n", f,
-          ftdi_get_error_string(nandflash_iobus));
-        ftdi_free(nandflash_iobus);
-        exit(-1);
+        return EXIT_FAILURE;
     }
-    printf("ftdi open succeeded(channel 1): %d\n", f);
-
-    printf("enabling bitbang mode(channel 1)\n");
-    ftdi_set_bitmode(nandflash_iobus, IOBUS_BITMASK_WRITE, BITMODE_BITBANG);
 
-    // Init 2. channel
-    if ((nandflash_controlbus = ftdi_new()) == NULL)
+    if (params.test && !bus->ops->set_pins)
     {
-        fprintf(stderr, "ftdi_new failed\n");
+        fprintf(stderr, "-t (tests) toggles pins by hand and does not work with "
+                        "the %s engine\n", bus->ops->name);
+        bus_close(bus);
         return EXIT_FAILURE;
     }
-    ftdi_set_interface(nandflash_controlbus, INTERFACE_B);
-    f = ftdi_usb_open(nandflash_controlbus, FT2232H_VID, FT2232H_PID);
-    if (f < 0 && f != -5)
-    {
-        fprintf(stderr, "unable to open ftdi device: %d (%s)\n", f,
-          ftdi_get_error_string(nandflash_controlbus));
-        ftdi_free(nandflash_controlbus);
-        exit(-1);
-    }
-    printf("ftdi open succeeded(channel 2): %d\n",f);
-
-    printf("enabling bitbang mode (channel 2)\n");
-    ftdi_set_bitmode(nandflash_controlbus, CONTROLBUS_BITMASK, BITMODE_BITBANG);
 
-    _usleep(500 * 1000);  // 500ms
+    bus_settle(bus, 500 * 1000);  // 500ms
 
-    controlbus_reset_value();
-    controlbus_update_output();
+    controlbus_reset_value(bus);
+    controlbus_update_output(bus);
 
-    iobus_set_direction(IOBUS_OUT);
-    iobus_reset_value();
-    iobus_update_output();
+    iobus_set_direction(bus, IOBUS_OUT);
+    iobus_reset_value(bus);
+    iobus_update_output(bus);
 
     if (params.test)
     {
         printf("Test mode; running tests, then aborting\n");
         run_tests(&params);
 
-        close_busses();
+        bus_close(bus);
 
         return 0;
     }
 
     printf("testing I/O and control bus for input read...\n");
-    iobus_set_direction(IOBUS_IN);
+    iobus_set_direction(bus, IOBUS_IN);
     //while(1)
     {
-        unsigned char iobus_val = iobus_read_input();
-        unsigned char controlbus_val = controlbus_read_input();
+        unsigned char iobus_val = iobus_read_input(bus);
+        unsigned char controlbus_val = controlbus_read_input(bus);
         printf("data read back: iobus=0x%02x, controlbus=0x%02x\n",
                 iobus_val, controlbus_val);
-        _usleep(1* 1000000);
+        bus_settle(bus, 1* 1000000);
     }
-    iobus_set_direction(IOBUS_OUT);
+    iobus_set_direction(bus, IOBUS_OUT);
 
-    // set nRE high and nCE and nWP low
-    controlbus_pin_set(PIN_nRE, ON);
-    controlbus_pin_set(PIN_nCE, OFF);
-    controlbus_pin_set(PIN_nWP, OFF); /* nWP low provides HW protection against undesired modify (program / erase) operations */
-    controlbus_update_output();
+    // set nRE and nWE high and nCE and nWP low
+    controlbus_pin_set(bus, PIN_nRE, ON);
+    controlbus_pin_set(bus, PIN_nWE, ON);
+    die_select(bus, 0);
+    controlbus_pin_set(bus, PIN_nWP, OFF); /* nWP low provides HW protection against undesired modify (program / erase) operations */
+    controlbus_update_output(bus);
 
     // Read the ID register
     {
         printf("Trying to read the ID register...\n");
+        read_id(&params, ID_register);
+        if (chip_identify(&params, ID_register) || window_setup(&params))
+        {
+            bus_close(bus);
+            return EXIT_FAILURE;
+        }
+    }
+    printf("Current NAND params: %s, page size: %d, page size (w/ OOB): %d, "
+           "pages per block: %d, block count: %d, page count: %d, planes: %d, "
+           "address cycles: %d+%d\n",
+           geometry.name, geometry.page_size_nospare, geometry.page_size,
+           geometry.pages_per_block, geometry.block_count, geometry.page_count,
+           geometry.planes, geometry.column_cycles, geometry.row_cycles);
+
+    if (params.start_block)
+    {
+        params.start_page = params.start_block * geometry.pages_per_block;
+    }
 
-        latch_command(&params, CMD_READID); /* command input operation; command: READ ID */
-
-        //unsigned char address[] = { 0x11, 0x22, 0x44, 0x88, 0xA5 };
-        //latch_address(address, 5);
-        unsigned char address[] = { 0x00 };
-        latch_address(&params, address, 1); /* address input operation */
+    /* the other dies must be the same chip, they get the first one's commands */
+    for (int d = 1; d < params.dies; d++)
+    {
+        unsigned char die_ID_register[5];
 
-        latch_register(&params, ID_register, 5); /* data output operation */
+        die_select(bus, d);
+        controlbus_update_output(bus);
+        read_id(&params, die_ID_register);
+        if (memcmp(die_ID_register, ID_register, sizeof(ID_register)))
+        {
+            fprintf(stderr, "Die %d ID register differs: 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
+                    d, die_ID_register[0], die_ID_register[1], die_ID_register[2],
+                    die_ID_register[3], die_ID_register[4]);
+            bus_close(bus);
+            return EXIT_FAILURE;
+        }
+        printf("Die %d ID register matches\n", d);
+    }
+    die_select(bus, 0);
+    controlbus_update_output(bus);
 
-        check_ID_register(ID_register);
+    if (!params.do_scan && bbt_load(&params, ID_register))
+    {
+        bus_close(bus);
+        return EXIT_FAILURE;
+    }
+    if (params.logical && !params.bad_blocks)
+    {
+        fprintf(stderr, "-L (logical image) needs the bad block table, scan it with -B\n");
+        bus_close(bus);
+        return EXIT_FAILURE;
     }
+    die_select(bus, 0);
+    controlbus_update_output(bus);
 
     int ret = 0;
-    if (params.do_program)
+    if (params.do_scan)
+    {
+        ret = bbt_scan(&params, ID_register);
+    }
+    else if (params.do_program)
     {
         ret = program_file(&params);
     }
+    else if (params.do_sync)
+    {
+        ret = sync_file(&params);
+    }
     else if (params.do_erase)
     {
         ret = erase_flash(&params);
     }
+    else if (params.do_move)
+    {
+        ret = move_blocks(&params);
+    }
     else
     {
         ret = dump_memory(&params);
     }
+    print_wait_stats(&params);
+    free(params.bad_blocks);
 
     // set nCE high
-    controlbus_pin_set(PIN_nCE, ON);
+    die_select(bus, DIE_NONE);
+    controlbus_update_output(bus);
 
     printf("done, 1 sec to go...\n");
-    _usleep(1 * 1000000);
+    bus_settle(bus, 1 * 1000000);
 
-    close_busses();
+    bus_close(bus);
 
     return ret;
 }
@@ -0,0 +1,592 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file ftdi-sim.c
+ * \brief Virtual FT2232H with a NAND flash wired to it, as a libftdi1 stand-in
+ * Implements the libftdi1 calls flash-tool makes. Instead of talking USB, the
+ * bytes written are played out on virtual pins: async and sync bit-bang on
+ * both channels, and the MPSSE / MCU host bus emulation command set on
+ * channel A. CLE/ALE/nWE/nRE edges are decoded into bus cycles of a
+ * simulated chip (nand-sim.c), so the real edge sequencing in flash-tool's
+ * latch_* functions is exercised end to end.
+ *
+ * Either link flash-tool against it (make flash-tool-sim) or preload it into
+ * the normal binary (make ftdi-sim.so; LD_PRELOAD=./ftdi-sim.so ./flash-tool).
+ * The chip lives in $FTDI_SIM_FILE (default ftdi-sim.bin). Every USB
+ * transaction is counted and the totals are printed on exit.
+ *
+ * With $FTDI_SIM_DIES=2, a second chip (in $FTDI_SIM_FILE.1) has its nCE on
+ * the LED pin, or ACBUS0 in host bus emulation mode; both drive RDY.
+ *
+ * The device reports serial number $FTDI_SIM_SERIAL (default FTSIM001). With
+ * $FTDI_SIM_MAX_BAUD set, bit-bang reads on channel A at a higher baud rate
+ * come back with bit errors, like a link run faster than the wiring allows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftdi.h>
+
+#include "nand-sim.h"
+
+/* Wiring and geometry, as in flash-tool.c */
+#define SIM_PIN_CLE  0x01
+#define SIM_PIN_ALE  0x02
+#define SIM_PIN_nCE  0x04
+#define SIM_PIN_nWE  0x08
+#define SIM_PIN_nRE  0x10
+#define SIM_PIN_nWP  0x20
+#define SIM_PIN_RDY  0x40
+#define SIM_PIN_nCE2 0x80
+#define SIM_MCU_ADDR_nCE 0x10
+#define SIM_MCU_ADDR_nWP 0x20
+#define SIM_MCU_ADDR_CLE 0x40
+#define SIM_MCU_ADDR_ALE 0x80
+#define SIM_MCU_ADDR_nCE2 0x01
+#define SIM_MCU_IO1_RDY  0x02
+
+#define SIM_PAGE_SIZE 2112
+#define SIM_PAGE_PER_BLOCK 64
+#define SIM_BLOCK_COUNT 2048
+
+#define SIM_DEFAULT_FILE "ftdi-sim.bin"
+#define SIM_USB_LATENCY_NS 125000ULL /* one USB round trip, a high speed microframe */
+#define SIM_BYTE_NS 100ULL           /* one byte clocked out on the pins, by default */
+#define SIM_CLOCKS_PER_BAUD 16       /* bit-bang updates per baud clock */
+#define SIM_FIFO_SIZE 65536
+#define SIM_CHUNKSIZE 4096
+#define SIM_DEFAULT_SERIAL "FTSIM001"
+#define SIM_ERROR_INTERVAL 61        /* every n-th sample is bad above the max baud rate */
+#define SIM_DIES_MAX 2
+
+static const unsigned char sim_nce_pins[SIM_DIES_MAX] = { SIM_PIN_nCE, SIM_PIN_nCE2 };
+
+typedef struct _sim_channel {
+    struct ftdi_context ctx;  /* first, handed out as the libftdi context */
+    int interface;            /* 0: A, 1: B */
+    unsigned char mode;       /* BITMODE_* */
+    unsigned char low_out, low_dir;   /* xDBUS */
+    unsigned char high_out, high_dir; /* xCBUS (MPSSE) */
+    unsigned char fifo[SIM_FIFO_SIZE]; /* bytes waiting for ftdi_read_data() */
+    int fifo_len;
+    unsigned char cmd[4];     /* MPSSE command being assembled */
+    int cmd_len;
+} sim_channel_t;
+
+static struct {
+    nand_sim_t *chips[SIM_DIES_MAX]; /* on the virtual clock of the first one */
+    int dies;
+    sim_channel_t *chan[2];
+    unsigned char control;    /* control lines as last seen by the chip */
+    unsigned char dout;       /* what the chip drives on IO0..7 */
+    unsigned char mcu_addr;   /* host bus high address byte */
+    int opened;
+    unsigned long samples;    /* channel A samples, for the bit error model */
+    unsigned long writes, bytes, reads, bulk_reads, bitmodes;
+} sim;
+
+static void sim_report(void)
+{
+    if (!sim.opened)
+    {
+        return;
+    }
+    fprintf(stderr, "ftdi-sim: %lu USB transactions: %lu writes (%lu bytes), %lu pin reads, "
+            "%lu bulk reads, %lu bitmode changes; simulated time %.3f s\n",
+            sim.writes + sim.reads + sim.bulk_reads + sim.bitmodes,
+            sim.writes, sim.bytes, sim.reads, sim.bulk_reads, sim.bitmodes,
+            sim.dies ? sim.chips[0]->now_ns / 1e9 : 0.0);
+    for (int d = 0; d < sim.dies; d++)
+    {
+        nand_sim_close(sim.chips[d]);
+    }
+    sim.dies = 0;
+}
+
+static void sim_advance(uint64_t ns)
+{
+    for (int d = 0; d < sim.dies; d++)
+    {
+        nand_sim_advance(sim.chips[d], ns);
+    }
+}
+
+static void sim_transaction(void)
+{
+    sim_advance(SIM_USB_LATENCY_NS);
+}
+
+static sim_channel_t *sim_chan(struct ftdi_context *ftdi)
+{
+    return (sim_channel_t *)ftdi;
+}
+
+/* Apply control lines; nWE rising edges latch, nRE falling edges drive data */
+static void sim_control(unsigned char control, unsigned char io)
+{
+    unsigned char old = sim.control;
+    sim.control = control;
+
+    for (int d = 0; d < sim.dies; d++)
+    {
+        nand_sim_t *chip = sim.chips[d];
+
+        nand_sim_set_wp(chip, !(control & SIM_PIN_nWP));
+        if (control & sim_nce_pins[d])
+        {
+            continue;
+        }
+
+        if (!(old & SIM_PIN_nWE) && (control & SIM_PIN_nWE))
+        {
+            if (control & SIM_PIN_CLE)
+                nand_sim_command(chip, io);
+            else if (control & SIM_PIN_ALE)
+                nand_sim_address(chip, io);
+            else
+                nand_sim_write(chip, io);
+        }
+
+        if ((old & SIM_PIN_nRE) && !(control & SIM_PIN_nRE))
+        {
+            sim.dout = nand_sim_read(chip);
+        }
+    }
+}
+
+/* RDY is wired-OR: low while any chip is busy */
+static unsigned char sim_rdy(void)
+{
+    for (int d = 0; d < sim.dies; d++)
+    {
+        if (!nand_sim_ready(sim.chips[d]))
+        {
+            return 0;
+        }
+    }
+    return sim.dies > 0;
+}
+
+/* I/O bus as seen on the pins: our outputs, the chip's data on the inputs */
+static unsigned char sim_io_pins(void)
+{
+    sim_channel_t *a = sim.chan[0];
+    unsigned char pins = (a->low_out & a->low_dir) | (sim.dout & ~a->low_dir);
+    const char *max_baud = getenv("FTDI_SIM_MAX_BAUD");
+
+    if (max_baud && a->ctx.baudrate > atoi(max_baud)
+        && (a->mode == BITMODE_BITBANG || a->mode == BITMODE_SYNCBB)
+        && ++sim.samples % SIM_ERROR_INTERVAL == 0)
+    {
+        pins ^= 0x01;
+    }
+    return pins;
+}
+
+static unsigned char sim_control_pins(unsigned char out, unsigned char dir)
+{
+    return (out & dir) | (sim_rdy() ? SIM_PIN_RDY : 0);
+}
+
+/* Control lines come from channel B in bit-bang, from ACBUS in MPSSE mode */
+static void sim_pins_changed(void)
+{
+    sim_channel_t *a = sim.chan[0];
+    sim_channel_t *b = sim.chan[1];
+
+    if (a && a->mode == BITMODE_MPSSE)
+        sim_control(a->high_out, a->low_out);
+    else if (a && b && b->mode != BITMODE_RESET)
+        sim_control(b->low_out, a->low_out);
+}
+
+static void sim_fifo_push(sim_channel_t *chan, unsigned char value)
+{
+    if (chan->fifo_len < SIM_FIFO_SIZE)
+    {
+        chan->fifo[chan->fifo_len++] = value;
+    }
+}
+
+static int sim_fifo_pop(sim_channel_t *chan, unsigned char *buf, int size)
+{
+    int len = size < chan->fifo_len ? size : chan->fifo_len;
+
+    memcpy(buf, chan->fifo, len);
+    memmove(chan->fifo, chan->fifo + len, chan->fifo_len - len);
+    chan->fifo_len -= len;
+    return len;
+}
+
+static void sim_mcu_cycle(int write, unsigned char data)
+{
+    unsigned char control = SIM_PIN_nWE | SIM_PIN_nRE;
+    unsigned char a = sim.mcu_addr;
+
+    if (a & SIM_MCU_ADDR_nCE)
+        control |= SIM_PIN_nCE;
+    if (a & SIM_MCU_ADDR_nCE2)
+        control |= SIM_PIN_nCE2;
+    if (a & SIM_MCU_ADDR_nWP)
+        control |= SIM_PIN_nWP;
+    if (a & SIM_MCU_ADDR_CLE)
+        control |= SIM_PIN_CLE;
+    if (a & SIM_MCU_ADDR_ALE)
+        control |= SIM_PIN_ALE;
+
+    /* one WR# or RD# strobe */
+    sim_control(control, data);
+    sim_control(control & ~(write ? SIM_PIN_nWE : SIM_PIN_nRE), data);
+    sim_control(control, data);
+}
+
+/* Length of an MPSSE / host bus command, opcode included */
+static int sim_mpsse_length(unsigned char op)
+{
+    switch (op)
+    {
+    case WRITE_EXTENDED:
+        return 4;
+    case SET_BITS_LOW:
+    case SET_BITS_HIGH:
+    case READ_EXTENDED:
+    case WRITE_SHORT:
+        return 3;
+    case READ_SHORT:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+static void sim_mpsse_command(sim_channel_t *chan)
+{
+    unsigned char *c = chan->cmd;
+
+    switch (c[0])
+    {
+    case SET_BITS_LOW:
+        chan->low_out = c[1];
+        chan->low_dir = c[2];
+        sim_pins_changed();
+        break;
+    case SET_BITS_HIGH:
+        chan->high_out = c[1];
+        chan->high_dir = c[2];
+        sim_pins_changed();
+        break;
+    case GET_BITS_LOW:
+        sim_fifo_push(chan, sim_io_pins());
+        break;
+    case GET_BITS_HIGH:
+        if (chan->mode == BITMODE_MCU)
+            sim_fifo_push(chan, (chan->high_out & chan->high_dir)
+                                | (sim_rdy() ? SIM_MCU_IO1_RDY : 0));
+        else
+            sim_fifo_push(chan, sim_control_pins(chan->high_out, chan->high_dir));
+        break;
+    case WRITE_EXTENDED:
+        sim.mcu_addr = c[1];
+        sim_mcu_cycle(1, c[3]);
+        break;
+    case WRITE_SHORT:
+        sim_mcu_cycle(1, c[2]);
+        break;
+    case READ_EXTENDED:
+        sim.mcu_addr = c[1];
+        sim_mcu_cycle(0, 0);
+        sim_fifo_push(chan, sim.dout);
+        break;
+    case READ_SHORT:
+        sim_mcu_cycle(0, 0);
+        sim_fifo_push(chan, sim.dout);
+        break;
+    case SEND_IMMEDIATE:
+    case DIS_DIV_5:
+    case EN_DIV_5:
+        break;
+    default:
+        fprintf(stderr, "ftdi-sim: unsupported MPSSE command 0x%02X\n", c[0]);
+        break;
+    }
+}
+
+static void sim_write_byte(sim_channel_t *chan, unsigned char value)
+{
+    if (chan->mode == BITMODE_MPSSE || chan->mode == BITMODE_MCU)
+    {
+        /* commands may be split across writes */
+        chan->cmd[chan->cmd_len++] = value;
+        if (chan->cmd_len == sim_mpsse_length(chan->cmd[0]))
+        {
+            sim_mpsse_command(chan);
+            chan->cmd_len = 0;
+        }
+        return;
+    }
+
+    /* sync bit-bang samples the pins as the byte goes out */
+    if (chan->mode == BITMODE_SYNCBB)
+    {
+        sim_fifo_push(chan, chan->interface == 0 ? sim_io_pins()
+                            : sim_control_pins(chan->low_out, chan->low_dir));
+    }
+    chan->low_out = value;
+    sim_pins_changed();
+}
+
+struct ftdi_context *ftdi_new(void)
+{
+    sim_channel_t *chan = calloc(1, sizeof(*chan));
+    if (chan == NULL)
+    {
+        return NULL;
+    }
+    chan->ctx.writebuffer_chunksize = SIM_CHUNKSIZE;
+    chan->ctx.readbuffer_chunksize = SIM_CHUNKSIZE;
+    chan->ctx.error_str = "no error";
+    return &chan->ctx;
+}
+
+void ftdi_free(struct ftdi_context *ftdi)
+{
+    sim_channel_t *chan = sim_chan(ftdi);
+
+    if (sim.chan[chan->interface] == chan)
+    {
+        sim.chan[chan->interface] = NULL;
+    }
+    free(chan);
+}
+
+int ftdi_set_interface(struct ftdi_context *ftdi, enum ftdi_interface interface)
+{
+    sim_chan(ftdi)->interface = (interface == INTERFACE_B) ? 1 : 0;
+    return 0;
+}
+
+int ftdi_usb_open(struct ftdi_context *ftdi, int vendor, int product)
+{
+    sim_channel_t *chan = sim_chan(ftdi);
+
+    if (sim.dies == 0)
+    {
+        const char *path = getenv("FTDI_SIM_FILE");
+        const char *dies = getenv("FTDI_SIM_DIES");
+        int count = dies && atoi(dies) > 1 ? SIM_DIES_MAX : 1;
+        char die_path[4096];
+
+        for (int d = 0; d < count; d++)
+        {
+            snprintf(die_path, sizeof(die_path), d ? "%s.%d" : "%s",
+                     path ? path : SIM_DEFAULT_FILE, d);
+            sim.chips[d] = nand_sim_open(die_path, SIM_PAGE_SIZE, SIM_PAGE_PER_BLOCK,
+                                         SIM_BLOCK_COUNT);
+            if (sim.chips[d] == NULL)
+            {
+                while (sim.dies)
+                {
+                    nand_sim_close(sim.chips[--sim.dies]);
+                }
+                ftdi->error_str = "can't open the simulated chip";
+                return -3;
+            }
+            sim.dies++;
+        }
+        sim.control = SIM_PIN_nCE | SIM_PIN_nCE2 | SIM_PIN_nWE | SIM_PIN_nRE;
+    }
+    if (!sim.opened)
+    {
+        sim.opened = 1;
+        atexit(sim_report);
+    }
+
+    sim.chan[chan->interface] = chan;
+    return 0;
+}
+
+/* One FT2232H on the bus */
+int ftdi_usb_find_all(struct ftdi_context *ftdi, struct ftdi_device_list **devlist,
+                      int vendor, int product)
+{
+    if ((*devlist = calloc(1, sizeof(**devlist))) == NULL)
+    {
+        return -3;
+    }
+    return 1;
+}
+
+void ftdi_list_free(struct ftdi_device_list **devlist)
+{
+    free(*devlist);
+    *devlist = NULL;
+}
+
+int ftdi_usb_get_strings(struct ftdi_context *ftdi, struct libusb_device *dev,
+                         char *manufacturer, int mnf_len, char *description, int desc_len,
+                         char *serial, int serial_len)
+{
+    const char *sim_serial = getenv("FTDI_SIM_SERIAL");
+
+    if (manufacturer)
+        snprintf(manufacturer, mnf_len, "FTDI");
+    if (description)
+        snprintf(description, desc_len, "Dual RS232-HS");
+    if (serial)
+        snprintf(serial, serial_len, "%s", sim_serial ? sim_serial : SIM_DEFAULT_SERIAL);
+    return 0;
+}
+
+int ftdi_usb_close(struct ftdi_context *ftdi)
+{
+    return 0;
+}
+
+int ftdi_set_bitmode(struct ftdi_context *ftdi, unsigned char bitmask, unsigned char mode)
+{
+    sim_channel_t *chan = sim_chan(ftdi);
+
+    sim.bitmodes++;
+    sim_transaction();
+    chan->mode = mode;
+    chan->low_dir = bitmask;
+    chan->fifo_len = 0;
+    chan->cmd_len = 0;
+    sim_pins_changed();
+    return 0;
+}
+
+int ftdi_disable_bitbang(struct ftdi_context *ftdi)
+{
+    return ftdi_set_bitmode(ftdi, 0x00, BITMODE_RESET);
+}
+
+int ftdi_set_latency_timer(struct ftdi_context *ftdi, unsigned char latency)
+{
+    return 0;
+}
+
+int ftdi_write_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize)
+{
+    ftdi->writebuffer_chunksize = chunksize;
+    return 0;
+}
+
+int ftdi_read_data_set_chunksize(struct ftdi_context *ftdi, unsigned int chunksize)
+{
+    ftdi->readbuffer_chunksize = chunksize;
+    return 0;
+}
+
+int ftdi_set_baudrate(struct ftdi_context *ftdi, int baudrate)
+{
+    ftdi->baudrate = baudrate;
+    return 0;
+}
+
+int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size)
+{
+    sim_channel_t *chan = sim_chan(ftdi);
+
+    for (int done = 0; done < size; done += ftdi->writebuffer_chunksize)
+    {
+        sim.writes++;
+        sim_transaction();
+    }
+    sim.bytes += size;
+
+    uint64_t byte_ns = SIM_BYTE_NS;
+    if (ftdi->baudrate > 0 && (chan->mode == BITMODE_BITBANG || chan->mode == BITMODE_SYNCBB))
+    {
+        byte_ns = 1000000000ULL / ((uint64_t)ftdi->baudrate * SIM_CLOCKS_PER_BAUD);
+    }
+
+    for (int k = 0; k < size; k++)
+    {
+        sim_advance(byte_ns);
+        sim_write_byte(chan, buf[k]);
+    }
+    return size;
+}
+
+int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+    sim.bulk_reads++;
+    sim_transaction();
+    return sim_fifo_pop(sim_chan(ftdi), buf, size);
+}
+
+int ftdi_read_pins(struct ftdi_context *ftdi, unsigned char *pins)
+{
+    sim_channel_t *chan = sim_chan(ftdi);
+
+    sim.reads++;
+    sim_transaction();
+    *pins = chan->interface == 0 ? sim_io_pins()
+                                 : sim_control_pins(chan->low_out, chan->low_dir);
+    return 0;
+}
+
+/* Transfers complete right away; the control block only carries the size */
+static struct ftdi_transfer_control *sim_tc(struct ftdi_context *ftdi, int size)
+{
+    struct ftdi_transfer_control *tc = calloc(1, sizeof(*tc));
+    if (tc)
+    {
+        tc->ftdi = ftdi;
+        tc->size = size;
+        tc->completed = 1;
+    }
+    return tc;
+}
+
+struct ftdi_transfer_control *ftdi_write_data_submit(struct ftdi_context *ftdi,
+                                                     unsigned char *buf, int size)
+{
+    return sim_tc(ftdi, ftdi_write_data(ftdi, buf, size));
+}
+
+struct ftdi_transfer_control *ftdi_read_data_submit(struct ftdi_context *ftdi,
+                                                    unsigned char *buf, int size)
+{
+    int got = ftdi_read_data(ftdi, buf, size);
+
+    /* the real transfer waits for all size bytes, everything is there already */
+    if (got < size)
+    {
+        fprintf(stderr, "ftdi-sim: async read of %d bytes, only %d available\n", size, got);
+    }
+    return sim_tc(ftdi, got);
+}
+
+int ftdi_transfer_data_done(struct ftdi_transfer_control *tc)
+{
+    int size = tc->size;
+    free(tc);
+    return size;
+}
+
+const char *ftdi_get_error_string(struct ftdi_context *ftdi)
+{
+    return ftdi->error_str;
+}
+
+struct ftdi_version_info ftdi_get_library_version(void)
+{
+    struct ftdi_version_info version = { 1, 5, 0, "ftdi-sim", "pin level simulator" };
+    return version;
+}
@@ -0,0 +1,660 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file nand-sim.c
+ * \brief Simulated x8 NAND flash device, at the command level
+ * Understands the commands flash-tool issues: READ ID (90h), page read
+ * (00h/30h, 00h alone after a status read), cache read (31h/3Fh), page
+ * program (80h/10h) and cache program (80h/15h), random data input (85h
+ * and a column), copy-back within a plane (00h/35h then 85h/10h), block
+ * erase (60h/D0h), read status (70h, or 78h with a row address, the chip
+ * being a single die) and reset (FFh). Reads, programs and erases also come
+ * in multi-plane flavours, ONFI style: ops on all but the last plane are
+ * queued with 32h, 11h or D1h, the last one runs them all; 06h/E0h then
+ * picks the plane (and column) to read out. Random data output (05h/E0h)
+ * moves data output to another column. With NAND_SIM_ONFI set in the
+ * environment the chip is ONFI: READ ID at 20h returns "ONFI" and ECh its
+ * parameter page, and NAND_SIM_ONFI=<main>+<spare>:<pages per block>:<blocks>
+ * changes its geometry.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nand-sim.h"
+
+static const unsigned char nand_sim_id[5] = { 0xAD, 0xDC, 0x10, 0x95, 0x54 };
+static const unsigned char nand_sim_onfi_id[4] = { 'O', 'N', 'F', 'I' };
+
+static void nand_sim_free(nand_sim_t *sim)
+{
+    free(sim->page_reg);
+    free(sim->cache_reg);
+    free(sim->onfi_reg);
+    free(sim->uid_reg);
+    for (int i = 0; i < NAND_SIM_PLANES; i++)
+    {
+        free(sim->plane_reg[i]);
+    }
+    free(sim);
+}
+
+static void nand_sim_put16(unsigned char *p, unsigned int value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+}
+
+static void nand_sim_put32(unsigned char *p, unsigned int value)
+{
+    nand_sim_put16(p, value & 0xFFFF);
+    nand_sim_put16(p + 2, value >> 16);
+}
+
+/* ONFI parameter page describing the simulated chip, three copies */
+static void nand_sim_onfi_page(nand_sim_t *sim, unsigned int spare_size)
+{
+    unsigned char *p = sim->onfi_reg;
+    unsigned int crc = 0x4F4E;
+
+    memset(sim->onfi_reg, 0x00, sim->page_size);
+    memcpy(p, nand_sim_onfi_id, sizeof(nand_sim_onfi_id));
+    nand_sim_put16(p + 4, 0x0002);  /* ONFI 1.0 */
+    nand_sim_put16(p + 6, 0x0048);  /* multi-plane program / erase and read */
+    nand_sim_put16(p + 8, 0x003B);  /* cache program, cache read, 78h, copy-back, EDh */
+    memcpy(p + 32, "SIMULATED   ", 12);
+    memcpy(p + 44, "NAND-SIM            ", 20);
+    nand_sim_put32(p + 80, sim->page_size - spare_size);
+    nand_sim_put16(p + 84, spare_size);
+    nand_sim_put32(p + 92, sim->pages_per_block);
+    nand_sim_put32(p + 96, sim->block_count);
+    p[100] = 1;                     /* LUNs */
+    p[101] = 0x23;                  /* 2 column, 3 row address cycles */
+    p[110] = 4;                     /* partial programs per page (NOP) */
+    p[113] = 1;                     /* interleaved (plane) address bits */
+
+    /* CRC-16, polynomial 8005h, over bytes 0-253 */
+    for (int i = 0; i < 254; i++)
+    {
+        crc ^= p[i] << 8;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+        }
+    }
+    nand_sim_put16(p + 254, crc & 0xFFFF);
+
+    memcpy(p + 256, p, 256);
+    memcpy(p + 512, p, 256);
+}
+
+/* Unique ID (EDh) derived from the backing file's path: 16 bytes and their
+ * complement, repeated 16 times */
+static void nand_sim_unique_id(nand_sim_t *sim, const char *path)
+{
+    unsigned int hash = 2166136261u;
+
+    for (const char *c = path; *c; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        hash = hash * 1103515245u + 12345u;
+        sim->uid_reg[i] = hash >> 24;
+        sim->uid_reg[i + 16] = ~sim->uid_reg[i];
+    }
+    for (int i = 32; i < 512; i += 32)
+    {
+        memcpy(sim->uid_reg + i, sim->uid_reg, 32);
+    }
+}
+
+nand_sim_t *nand_sim_open(const char *path, unsigned int page_size,
+                          unsigned int pages_per_block, unsigned int block_count)
+{
+    nand_sim_t *sim;
+    struct stat st;
+    int created = 0;
+    const char *onfi = getenv("NAND_SIM_ONFI");
+    unsigned int main_size = 2048, spare_size = page_size - 2048;
+
+    /* NAND_SIM_ONFI=1 or =<main>+<spare>:<pages per block>:<blocks>, an ONFI
+     * chip, with that geometry */
+    if (onfi && sscanf(onfi, "%u+%u:%u:%u", &main_size, &spare_size,
+                       &pages_per_block, &block_count) == 4)
+    {
+        page_size = main_size + spare_size;
+    }
+
+    if ((sim = calloc(1, sizeof(*sim))) == NULL)
+    {
+        fprintf(stderr, "nand-sim: malloc error\n");
+        return NULL;
+    }
+    sim->fd = -1;
+
+    sim->page_reg = malloc(page_size);
+    sim->cache_reg = malloc(page_size);
+    sim->onfi_reg = malloc(page_size);
+    sim->uid_reg = malloc(page_size);
+    for (int i = 0; i < NAND_SIM_PLANES; i++)
+    {
+        sim->plane_reg[i] = malloc(page_size);
+    }
+    if (!sim->page_reg || !sim->cache_reg || !sim->onfi_reg || !sim->uid_reg
+        || !sim->plane_reg[0]
+        || !sim->plane_reg[1])
+    {
+        fprintf(stderr, "nand-sim: malloc error\n");
+        goto fail;
+    }
+
+    sim->page_size = page_size;
+    sim->pages_per_block = pages_per_block;
+    sim->block_count = block_count;
+    sim->array_size = (size_t)page_size * pages_per_block * block_count;
+    sim->status = NAND_SIM_STATUS_RDY | NAND_SIM_STATUS_nWP;
+    memset(sim->page_reg, 0xFF, page_size);
+    memset(sim->cache_reg, 0xFF, page_size);
+    for (int i = 0; i < NAND_SIM_PLANES; i++)
+    {
+        memset(sim->plane_reg[i], 0xFF, page_size);
+    }
+    sim->out_reg = sim->page_reg;
+    if (onfi)
+    {
+        sim->onfi = 1;
+        nand_sim_onfi_page(sim, spare_size);
+        memset(sim->uid_reg, 0xFF, page_size);
+        nand_sim_unique_id(sim, path);
+    }
+
+    if ((sim->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0
+        || fstat(sim->fd, &st))
+    {
+        fprintf(stderr, "nand-sim: can't open %s\n", path);
+        goto fail;
+    }
+
+    if (st.st_size == 0)
+    {
+        if (ftruncate(sim->fd, sim->array_size))
+        {
+            fprintf(stderr, "nand-sim: can't size %s to %zu bytes\n", path, sim->array_size);
+            goto fail;
+        }
+        created = 1;
+    }
+    else if ((size_t)st.st_size != sim->array_size)
+    {
+        fprintf(stderr, "nand-sim: %s is %lld bytes, expected %zu for this geometry\n",
+                path, (long long)st.st_size, sim->array_size);
+        goto fail;
+    }
+
+    sim->array = mmap(NULL, sim->array_size, PROT_READ | PROT_WRITE, MAP_SHARED, sim->fd, 0);
+    if (sim->array == MAP_FAILED)
+    {
+        fprintf(stderr, "nand-sim: can't map %s\n", path);
+        sim->array = NULL;
+        goto fail;
+    }
+
+    if (created)
+    {
+        /* a new chip comes erased */
+        printf("nand-sim: created erased array in %s\n", path);
+        memset(sim->array, 0xFF, sim->array_size);
+    }
+
+    return sim;
+
+fail:
+    if (sim->fd >= 0)
+    {
+        close(sim->fd);
+    }
+    nand_sim_free(sim);
+    return NULL;
+}
+
+void nand_sim_close(nand_sim_t *sim)
+{
+    if (sim->array)
+    {
+        munmap(sim->array, sim->array_size);
+    }
+    close(sim->fd);
+    nand_sim_free(sim);
+}
+
+int nand_sim_ready(nand_sim_t *sim)
+{
+    return sim->now_ns >= sim->busy_until_ns;
+}
+
+void nand_sim_advance(nand_sim_t *sim, uint64_t ns)
+{
+    sim->now_ns += ns;
+}
+
+void nand_sim_set_wp(nand_sim_t *sim, int write_protect)
+{
+    sim->write_protect = write_protect;
+}
+
+static void nand_sim_busy(nand_sim_t *sim, uint64_t ns)
+{
+    sim->busy_until_ns = sim->now_ns + ns;
+    sim->array_busy_until_ns = sim->busy_until_ns;
+}
+
+/* Row address from the address cycles, checked against the array size */
+static int nand_sim_row(nand_sim_t *sim, int first, unsigned int *row)
+{
+    *row = sim->addr[first] | (sim->addr[first + 1] << 8) | (sim->addr[first + 2] << 16);
+    if (*row >= sim->pages_per_block * sim->block_count)
+    {
+        fprintf(stderr, "nand-sim: page %u out of range\n", *row);
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned char *nand_sim_page(nand_sim_t *sim, unsigned int row)
+{
+    return sim->array + (size_t)row * sim->page_size;
+}
+
+static int nand_sim_plane(nand_sim_t *sim, unsigned int row)
+{
+    return (row / sim->pages_per_block) % NAND_SIM_PLANES;
+}
+
+/* Queue a multi-plane op on the plane of row; only one per plane */
+static int nand_sim_queue_plane(nand_sim_t *sim, unsigned int row)
+{
+    int bit = 1 << nand_sim_plane(sim, row);
+
+    if (sim->planes_queued & bit)
+    {
+        fprintf(stderr, "nand-sim: two multi-plane ops on plane %d\n", nand_sim_plane(sim, row));
+        return -1;
+    }
+    sim->planes_queued |= bit;
+    return 0;
+}
+
+/* 30h, or 32h (queue) for a multi-plane read */
+static void nand_sim_page_read(nand_sim_t *sim, int queue)
+{
+    if (sim->addr_count != 5 || nand_sim_row(sim, 2, &sim->row)
+        || nand_sim_queue_plane(sim, sim->row))
+    {
+        fprintf(stderr, "nand-sim: bad page read address\n");
+        sim->planes_queued = 0;
+        return;
+    }
+    sim->column = sim->addr[0] | (sim->addr[1] << 8);
+    memcpy(sim->plane_reg[nand_sim_plane(sim, sim->row)], nand_sim_page(sim, sim->row),
+           sim->page_size);
+    sim->reads++;
+
+    if (queue)
+    {
+        sim->busy_until_ns = sim->now_ns + NAND_SIM_T_DBSY_NS;
+        return;
+    }
+
+    memcpy(sim->page_reg, nand_sim_page(sim, sim->row), sim->page_size);
+    sim->planes_queued = 0;
+    sim->out_data = 1;
+    sim->out_reg = sim->page_reg;
+    nand_sim_busy(sim, NAND_SIM_T_R_NS);
+}
+
+/* 06h-address-E0h: data output from the plane of the row, at the column */
+static void nand_sim_select_plane(nand_sim_t *sim)
+{
+    unsigned int row;
+
+    if (sim->addr_count != 5 || nand_sim_row(sim, 2, &row))
+    {
+        fprintf(stderr, "nand-sim: bad change read column address\n");
+        return;
+    }
+    sim->column = sim->addr[0] | (sim->addr[1] << 8);
+    sim->out_data = 1;
+    sim->out_reg = sim->plane_reg[nand_sim_plane(sim, row)];
+}
+
+/* 05h-column-E0h: data output of the same register, from the new column */
+static void nand_sim_read_column(nand_sim_t *sim)
+{
+    if (sim->addr_count != 2 || sim->out_reg == NULL)
+    {
+        fprintf(stderr, "nand-sim: bad random data output\n");
+        return;
+    }
+    sim->column = sim->addr[0] | (sim->addr[1] << 8);
+    sim->out_data = 1;
+}
+
+/*
+ * Cache read: once the array is done with the page register, it moves to
+ * the cache register for data output; with 31h the array then loads the
+ * next page into the page register meanwhile, 3Fh ends the sequence.
+ */
+static void nand_sim_cache_read(nand_sim_t *sim, int next)
+{
+    uint64_t start_ns = sim->now_ns > sim->array_busy_until_ns ?
+                        sim->now_ns : sim->array_busy_until_ns;
+
+    memcpy(sim->cache_reg, sim->page_reg, sim->page_size);
+    sim->busy_until_ns = start_ns + NAND_SIM_T_DCBSYR_NS;
+    sim->array_busy_until_ns = sim->busy_until_ns;
+    sim->column = 0;
+    sim->out_data = 1;
+    sim->out_reg = sim->cache_reg;
+
+    if (next)
+    {
+        if (sim->row + 1 >= sim->pages_per_block * sim->block_count)
+        {
+            fprintf(stderr, "nand-sim: cache read past the last page\n");
+            return;
+        }
+        sim->row++;
+        memcpy(sim->page_reg, nand_sim_page(sim, sim->row), sim->page_size);
+        sim->reads++;
+        sim->array_busy_until_ns += NAND_SIM_T_R_NS;
+    }
+}
+
+/*
+ * Program the data input register. With 15h (cache), the register is free
+ * again for the next 80h as soon as the array has taken the data, which is
+ * once the array is done with the previous program; with 10h, only once
+ * this program is done too; 11h queues it for a multi-plane program. FAIL
+ * is the result of this program (of any of its planes), FAILC the one of the
+ * program before.
+ */
+static void nand_sim_page_program(nand_sim_t *sim, unsigned char confirm)
+{
+    unsigned char *page;
+    uint64_t start_ns = sim->now_ns > sim->array_busy_until_ns ?
+                        sim->now_ns : sim->array_busy_until_ns;
+
+    if (!sim->planes_queued)
+    {
+        sim->status &= ~NAND_SIM_STATUS_FAILC;
+        if (sim->status & NAND_SIM_STATUS_FAIL)
+        {
+            sim->status |= NAND_SIM_STATUS_FAILC;
+        }
+        sim->status &= ~NAND_SIM_STATUS_FAIL;
+    }
+
+    unsigned int source_row = sim->row;
+    if (sim->write_protect || nand_sim_row(sim, 2, &sim->row)
+        || nand_sim_queue_plane(sim, sim->row))
+    {
+        sim->status |= NAND_SIM_STATUS_FAIL;
+    }
+    else if (sim->copy_back && nand_sim_plane(sim, source_row) != nand_sim_plane(sim, sim->row))
+    {
+        fprintf(stderr, "nand-sim: copy-back from page %u to page %u, another plane\n",
+                source_row, sim->row);
+        sim->status |= NAND_SIM_STATUS_FAIL;
+    }
+    else
+    {
+        /* programming can only clear bits */
+        page = nand_sim_page(sim, sim->row);
+        for (unsigned int k = 0; k < sim->page_size; k++)
+        {
+            page[k] &= sim->page_reg[k];
+        }
+        sim->programs++;
+        if (sim->copy_back)
+            sim->copy_backs++;
+    }
+
+    if (confirm == 0x11)
+    {
+        sim->busy_until_ns = sim->now_ns + NAND_SIM_T_DBSY_NS;
+        return;
+    }
+
+    sim->planes_queued = 0;
+    if (confirm == 0x15)
+    {
+        sim->busy_until_ns = start_ns + NAND_SIM_T_CBSY_NS;
+        sim->array_busy_until_ns = sim->busy_until_ns + NAND_SIM_T_PROG_NS;
+    }
+    else
+    {
+        sim->busy_until_ns = start_ns + NAND_SIM_T_PROG_NS;
+        sim->array_busy_until_ns = sim->busy_until_ns;
+    }
+}
+
+/* D0h, or D1h to queue it for a multi-plane erase */
+static void nand_sim_block_erase(nand_sim_t *sim, int queue)
+{
+    unsigned int row;
+
+    if (!sim->planes_queued)
+    {
+        sim->status &= ~NAND_SIM_STATUS_FAIL;
+    }
+
+    if (sim->write_protect || sim->addr_count != 3 || nand_sim_row(sim, 0, &row)
+        || nand_sim_queue_plane(sim, row))
+    {
+        sim->status |= NAND_SIM_STATUS_FAIL;
+    }
+    else
+    {
+        row -= row % sim->pages_per_block;
+        memset(nand_sim_page(sim, row), 0xFF, (size_t)sim->page_size * sim->pages_per_block);
+        sim->erases++;
+    }
+
+    if (queue)
+    {
+        sim->busy_until_ns = sim->now_ns + NAND_SIM_T_DBSY_NS;
+        return;
+    }
+
+    sim->planes_queued = 0;
+    nand_sim_busy(sim, NAND_SIM_T_BERS_NS);
+}
+
+void nand_sim_command(nand_sim_t *sim, unsigned char cmd)
+{
+    if (!nand_sim_ready(sim) && cmd != 0x70 && cmd != 0x78 && cmd != 0xFF)
+    {
+        fprintf(stderr, "nand-sim: command 0x%02X while busy, ignored\n", cmd);
+        return;
+    }
+
+    sim->out_id = 0;
+    sim->out_status = 0;
+    if (cmd != 0x00 && cmd != 0x70 && cmd != 0x78 && cmd != 0x31 && cmd != 0x3F)
+    {
+        /* 00h alone goes back to data output after a status read */
+        sim->out_data = 0;
+    }
+
+    switch (cmd)
+    {
+    case 0x00: /* page read, setup */
+    case 0x05: /* random data output, column follows */
+    case 0x06: /* change read column (plane select), setup */
+    case 0x60: /* block erase, setup */
+    case 0x78: /* read status enhanced, row address follows */
+    case 0x85: /* random data input or copy-back program, the page register stays */
+    case 0x90: /* read ID */
+    case 0xEC: /* read parameter page, ONFI chips */
+    case 0xED: /* read unique ID, ONFI chips */
+        sim->addr_count = 0;
+        break;
+    case 0x80: /* page program, setup */
+        sim->addr_count = 0;
+        sim->copy_back = 0;
+        memset(sim->page_reg, 0xFF, sim->page_size);
+        break;
+    case 0x30:
+    case 0x32:
+    case 0x35: /* for copy-back, same as 30h here */
+        if (sim->cmd == 0x00)
+            nand_sim_page_read(sim, cmd == 0x32);
+        sim->copy_back = cmd == 0x35;
+        break;
+    case 0xE0:
+        if (sim->cmd == 0x06)
+            nand_sim_select_plane(sim);
+        else if (sim->cmd == 0x05)
+            nand_sim_read_column(sim);
+        break;
+    case 0x31:
+    case 0x3F:
+        if (sim->out_data)
+            nand_sim_cache_read(sim, cmd == 0x31);
+        break;
+    case 0x10:
+    case 0x11:
+    case 0x15:
+        if (sim->cmd == 0x80 || sim->cmd == 0x85)
+            nand_sim_page_program(sim, cmd);
+        break;
+    case 0xD0:
+    case 0xD1:
+        if (sim->cmd == 0x60)
+            nand_sim_block_erase(sim, cmd == 0xD1);
+        break;
+    case 0x70:
+        sim->out_status = 1;
+        break;
+    case 0xFF:
+        sim->addr_count = 0;
+        sim->planes_queued = 0;
+        sim->busy_until_ns = sim->now_ns;
+        sim->array_busy_until_ns = sim->now_ns;
+        break;
+    default:
+        fprintf(stderr, "nand-sim: unsupported command 0x%02X\n", cmd);
+        break;
+    }
+
+    if (cmd != 0x70)
+    {
+        sim->cmd = cmd;
+    }
+}
+
+void nand_sim_address(nand_sim_t *sim, unsigned char addr)
+{
+    if (sim->addr_count < (int)sizeof(sim->addr))
+    {
+        sim->addr[sim->addr_count] = addr;
+    }
+    sim->addr_count++;
+
+    if (sim->cmd == 0x78)
+    {
+        /* status output once the row is in, data output can resume after */
+        sim->out_status = sim->addr_count == 3;
+        return;
+    }
+
+    sim->out_data = 0;
+    if (sim->cmd == 0x90)
+    {
+        sim->out_id = 1;
+        sim->column = 0;
+    }
+    else if (sim->cmd == 0xEC && sim->onfi)
+    {
+        sim->out_data = 1;
+        sim->out_reg = sim->onfi_reg;
+        sim->column = 0;
+        nand_sim_busy(sim, NAND_SIM_T_R_NS);
+    }
+    else if (sim->cmd == 0xED && sim->onfi)
+    {
+        sim->out_data = 1;
+        sim->out_reg = sim->uid_reg;
+        sim->column = 0;
+        nand_sim_busy(sim, NAND_SIM_T_R_NS);
+    }
+    else if ((sim->cmd == 0x80 || sim->cmd == 0x85) && sim->addr_count == 2)
+    {
+        sim->column = sim->addr[0] | (sim->addr[1] << 8);
+    }
+}
+
+void nand_sim_write(nand_sim_t *sim, unsigned char data)
+{
+    if (sim->cmd != 0x80 && sim->cmd != 0x85)
+    {
+        return;
+    }
+    if (sim->column < sim->page_size)
+    {
+        sim->page_reg[sim->column] = data;
+    }
+    sim->column++;
+    sim->bytes_in++;
+}
+
+unsigned char nand_sim_read(nand_sim_t *sim)
+{
+    if (sim->out_status)
+    {
+        unsigned char status = sim->status & ~(NAND_SIM_STATUS_ARDY | NAND_SIM_STATUS_RDY
+                                               | NAND_SIM_STATUS_nWP);
+        if (nand_sim_ready(sim))
+            status |= NAND_SIM_STATUS_RDY;
+        if (sim->now_ns >= sim->array_busy_until_ns)
+            status |= NAND_SIM_STATUS_ARDY;
+        if (!sim->write_protect)
+            status |= NAND_SIM_STATUS_nWP;
+        return status;
+    }
+    else if (sim->out_id && sim->onfi && sim->addr[0] == 0x20)
+    {
+        return sim->column < sizeof(nand_sim_onfi_id) ? nand_sim_onfi_id[sim->column++] : 0x00;
+    }
+    else if (sim->out_id)
+    {
+        return sim->column < sizeof(nand_sim_id) ? nand_sim_id[sim->column++] : 0x00;
+    }
+    else if (sim->out_data && nand_sim_ready(sim))
+    {
+        sim->bytes_out++;
+        return sim->column < sim->page_size ? sim->out_reg[sim->column++] : 0xFF;
+    }
+
+    return 0xFF;
+}
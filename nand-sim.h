@@ -0,0 +1,103 @@
+/*
+ * This file is part of the ftdi-nand-flash-reader distribution (https://github.com/maehw/ftdi-nand-flash-reader).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * \file nand-sim.h
+ * \brief Simulated x8 NAND flash device, at the command level
+ * The array lives in a memory-mapped file. Busy times (tR, tPROG, tBERS) run
+ * on a virtual clock that the caller advances with the cost of its own bus
+ * traffic, so runs without hardware still give meaningful timings.
+ */
+
+#ifndef NAND_SIM_H
+#define NAND_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Busy times, typical values of a 2 Gbit SLC part (TC58NVG1S3H) */
+#define NAND_SIM_T_R_NS      25000ULL    /* 25 us, page read */
+#define NAND_SIM_T_PROG_NS   300000ULL   /* 300 us, page program */
+#define NAND_SIM_T_BERS_NS   2500000ULL  /* 2.5 ms, block erase */
+#define NAND_SIM_T_DCBSYR_NS 5000ULL     /* 5 us, page register to cache register (31h/3Fh) */
+#define NAND_SIM_T_CBSY_NS   5000ULL     /* 5 us, cache register to page register (15h) */
+#define NAND_SIM_T_DBSY_NS   1000ULL     /* 1 us, multi-plane op queued (11h, D1h, 32h) */
+
+#define NAND_SIM_PLANES 2 /* a block's plane is its lowest bit */
+
+/* Status register bits */
+#define NAND_SIM_STATUS_FAIL 0x01
+#define NAND_SIM_STATUS_FAILC 0x02 /* the program before the last one failed (cache program) */
+#define NAND_SIM_STATUS_ARDY 0x20 /* array ready, low while a cache read loads the next page */
+#define NAND_SIM_STATUS_RDY  0x40
+#define NAND_SIM_STATUS_nWP  0x80 /* 1: not write protected */
+
+typedef struct _nand_sim {
+    unsigned int page_size;       /* with spare area */
+    unsigned int pages_per_block;
+    unsigned int block_count;
+
+    int fd;
+    unsigned char *array;         /* memory-mapped backing file */
+    size_t array_size;
+    unsigned char *page_reg;      /* page (data) register */
+    unsigned char *cache_reg;     /* cache register, data output of cache reads */
+    unsigned char *plane_reg[NAND_SIM_PLANES]; /* per plane page registers (multi-plane reads) */
+    int planes_queued;            /* bit per plane with a multi-plane op queued */
+
+    unsigned char cmd;            /* last command latched */
+    unsigned char addr[5];
+    int addr_count;
+    unsigned int column;
+    unsigned int row;
+    unsigned char status;
+    int write_protect;            /* nWP low */
+    int out_id;                   /* data output: reading the ID */
+    int out_status;               /* data output: reading the status */
+    int out_data;                 /* data output: reading out_reg */
+    unsigned char *out_reg;       /* page, cache or plane register */
+    int copy_back;                /* the page register was loaded with 35h */
+    int onfi;                     /* answers READ ID 20h and ECh */
+    unsigned char *onfi_reg;      /* parameter page, three copies */
+    unsigned char *uid_reg;       /* unique ID and its complement, 16 copies */
+
+    uint64_t now_ns;              /* virtual clock */
+    uint64_t busy_until_ns;       /* RDY, the cache register is busy */
+    uint64_t array_busy_until_ns; /* ARDY, the array is busy (cache reads) */
+
+    /* what the run cost the chip */
+    unsigned long reads;
+    unsigned long programs;
+    unsigned long erases;
+    unsigned long copy_backs;     /* programs of a page loaded with 35h */
+    unsigned long bytes_out;
+    unsigned long bytes_in;
+} nand_sim_t;
+
+nand_sim_t *nand_sim_open(const char *path, unsigned int page_size,
+                          unsigned int pages_per_block, unsigned int block_count);
+void nand_sim_close(nand_sim_t *sim);
+
+/* Bus cycles: CLE high, ALE high, plain data in (nWE) and data out (nRE) */
+void nand_sim_command(nand_sim_t *sim, unsigned char cmd);
+void nand_sim_address(nand_sim_t *sim, unsigned char addr);
+void nand_sim_write(nand_sim_t *sim, unsigned char data);
+unsigned char nand_sim_read(nand_sim_t *sim);
+
+void nand_sim_set_wp(nand_sim_t *sim, int write_protect);
+int nand_sim_ready(nand_sim_t *sim);
+void nand_sim_advance(nand_sim_t *sim, uint64_t ns);
+
+#endif /* NAND_SIM_H */